@@ -10,4 +10,6 @@
 */
 
 typedef int buffer_item;
+
+// default capacity of the buffer, in items (or records with -r); -s overrides it.
 #define BUFFER_SIZE 5
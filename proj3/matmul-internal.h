@@ -0,0 +1,155 @@
+/*
+ *
+ * matmul-internal.h
+ *
+ * Project 3, Part 1 - libmatmul internals
+ *
+ * The worker pool, tiled multiply and kernel interfaces of libmatmul, for code built
+ * on the engine itself rather than on matmul.h: the sparse, streaming and chain
+ * drivers of matrix.x.  A Pool is the same object as a matmul_ctx.
+ *
+*/
+
+#ifndef MATMUL_INTERNAL_H
+#define MATMUL_INTERNAL_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+#include "matmul.h"
+
+// C is split into TILE_M x TILE_N tiles which are handed out to the pool.  Each
+// tile walks the shared dimension in TILE_K steps so the B panel stays in cache.
+// TILE_N is also the width of a packed B panel.
+#define TILE_M 64
+#define TILE_N 256
+#define TILE_K 256
+
+// most NUMA nodes a pool spreads its workers over.
+#define MAX_NODES 16
+
+#define MAT_INT32 MATMUL_INT32
+#define MAT_FLOAT32 MATMUL_FLOAT32
+
+// narrow element types of the quantized multiply.  They only exist in memory, as
+// operands of an int32 product.
+#define MAT_INT8 3
+#define MAT_INT16 4
+
+// one implementation of the inner kernels: c[0..n) += a * b[0..n).  features is
+// the cpu_features() mask the implementation needs.
+typedef struct kernels
+{
+  const char *name;
+  unsigned int features;
+  void (*axpy_i32)(int *c, int a, const int *b, int n);
+  void (*axpy_f32)(float *c, float a, const float *b, int n);
+} Kernels;
+
+// one instruction set's quantized kernels (see dot_i16_scalar).
+typedef struct quant_kernels
+{
+  const char *name;
+  unsigned int features;
+  void (*dot_i16)(int *c, int a, const int *b, int n);
+  void (*dot_i8)(int *c, int a, const int *b, int n);
+} QuantKernels;
+
+// fixed set of worker threads which all run the currently posted job.  When the
+// workers are pinned, cpu and node record where each one runs (nodes numbered
+// densely from 0); otherwise every worker counts as node 0.
+typedef struct matmul_ctx
+{
+  int nthreads;
+  pthread_t *tid;
+  int *cpu;
+  int *node;
+  int nnodes;
+  int node_workers[MAX_NODES];
+  pthread_mutex_t lock;
+  pthread_cond_t work_cv;
+  pthread_cond_t done_cv;
+  void (*job)(void *arg, int id);
+  void *arg;
+  unsigned long generation;
+  int pending;
+  int shutdown;
+} Pool;
+
+// B rearranged into column panels of at most TILE_N columns.  Each panel is stored
+// as k rows of width elements back to back (the last panel is zero padded), so the
+// tile that owns those columns reads its whole panel front to back.  A PackedB is
+// independent of A and C and may be reused for any number of multiplies.
+typedef struct matmul_packed
+{
+  int type;
+  int k, n;
+  int width;
+  int panels;
+  void *data;
+  const void *src;
+  int ld;
+  int next;
+} PackedB;
+
+// C = A*B over row-major operands, split into tiles.  Column panel p of B starts at
+// b + p * panel_stride and its rows are ldb elements apart, which describes both a
+// plain row-major B (panel_stride TILE_N) and a PackedB (panel_stride k * width).
+// Tiles are numbered row by row, and node n first claims tiles node_next[n] up to
+// node_end[n] (see gemm_partition).
+typedef struct gemm
+{
+  int type;
+  int m, n, k;
+  const void *a;
+  const void *b;
+  void *c;
+  int lda, ldb, ldc;
+  size_t panel_stride;
+  int accumulate;
+  int tiles_n;
+  int ntiles;
+  const int *node;
+  int nnodes;
+  int node_next[MAX_NODES];
+  int node_end[MAX_NODES];
+  int stolen;
+} Gemm;
+
+typedef matmul_triple Triple;
+
+// inner kernels in use, set by select_kernels (once, from matmul_create, unless
+// matmul_set_kernels picks others), and the quantized ones, set by select_quant.
+extern Kernels kern;
+extern QuantKernels qkern;
+
+Pool *pool_create(int nthreads, int pin);
+void pool_run(Pool *pool, void (*job)(void *arg, int id), void *arg);
+void pool_destroy(Pool *pool);
+
+void gemm_pool(Pool *pool, int type, int m, int n, int k, const void *a, int lda,
+               const void *b, int ldb, void *c, int ldc);
+void gemm_packed(Pool *pool, int m, const void *a, int lda, const PackedB *pb,
+                 void *c, int ldc);
+void gemm_run(Pool *pool, Gemm *g);
+void gemm_tile(const Gemm *g, int t);
+void gemm_steal(Pool *pool, int type, int m, int n, int k, const void *a, int lda,
+                const void *b, int ldb, void *c, int ldc, int strassen);
+void gemm_batch(Pool *pool, int type, int m, int n, int k, const Triple *batch, int count,
+                int lda, int ldb, int ldc);
+void pack_b(Pool *pool, PackedB *pb, int type, int k, int n, const void *b, int ldb);
+void free_packed(PackedB *pb);
+void numa_touch(Pool *pool, int type, int rows, int cols, void *c, int ldc);
+
+unsigned int cpu_features(void);
+int select_kernels(const char *name);
+int select_quant(const char *name);
+int quant_size(int type);
+int *quant_a(int type, int rows, int cols, const int *a, int lda, int groups);
+int quant_b(Pool *pool, PackedB *pb, int type, int k, int n, const int *b, int ldb,
+            int groups);
+
+size_t type_size(int type);
+void *elem_at(const void *base, int type, size_t row, int ld, size_t col);
+
+#endif
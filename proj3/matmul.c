@@ -0,0 +1,2066 @@
+/*
+ *
+ * matmul.c
+ *
+ * Project 3, Part 1 - libmatmul, the multiply engine behind matrix.x
+ *
+ * Implements matmul.h over a persistent worker pool: tiled multiplies with B read in
+ * place or packed into column panels, a work-stealing divide-and-conquer multiply
+ * with optional Strassen, batches of small products, and the int8/int16 quantized
+ * multiply.  The inner kernels are compiled for several instruction sets and the
+ * fastest one the CPU supports is picked at run time (see select_kernels).
+ *
+ * Built as libmatmul.a and libmatmul.so by the makefile.
+ *
+*/
+
+// for sched_setaffinity and the CPU_* macros.
+#define _GNU_SOURCE
+
+// the divide-and-conquer multiply stops splitting once a block has at most DC_LEAF
+// multiply-adds, or every dimension is at most DC_MIN, and splits on multiples of
+// DC_ALIGN (one AVX-512 vector) where it can.  Each worker's deque holds
+// DEQUE_SIZE pending tasks, far more than the recursion depth can produce.
+#define DC_LEAF (TILE_M * TILE_N * TILE_K)
+#define DC_MIN 32
+#define DC_ALIGN 16
+#define DEQUE_SIZE 256
+
+// batched small products are handed out BATCH_CHUNK at a time.
+#define BATCH_CHUNK 256
+
+// most CPUs read from the sysfs NUMA topology.
+#define MAX_CPUS 1024
+
+// SIMD kernels are written with GCC vector extensions and compiled for each
+// instruction set with the target attribute, so one binary carries all of them and
+// select_kernels picks one at run time.  AVX-512 code generation needs GCC 4.9.
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86_KERNELS 1
+#if __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)
+#define HAVE_AVX512_KERNELS 1
+#endif
+#endif
+
+// the quantized kernels need intrinsics (for pmaddwd) inside target functions, which
+// also arrived in GCC 4.9, and VNNI needs GCC 8.
+#ifdef HAVE_AVX512_KERNELS
+#define HAVE_QUANT_KERNELS 1
+#if __GNUC__ >= 8
+#define HAVE_VNNI_KERNELS 1
+#endif
+#endif
+
+// cpuid feature bits (leaf 1 ecx, leaf 7 ebx, and leaf 7 ecx for VNNI) and the cpu_features() mask.
+#define CPUID_SSE41 (1 << 19)
+#define CPUID_OSXSAVE (1 << 27)
+#define CPUID_AVX (1 << 28)
+#define CPUID_AVX2 (1 << 5)
+#define CPUID_AVX512F (1 << 16)
+#define CPUID_AVX512BW (1 << 30)
+#define CPUID_AVX512VNNI (1 << 11)
+
+#define CPU_SSE41 0x1
+#define CPU_AVX2 0x2
+#define CPU_AVX512F 0x4
+#define CPU_AVX512BW 0x8
+#define CPU_AVX512VNNI 0x10
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+
+#ifdef HAVE_X86_KERNELS
+#include <cpuid.h>
+#endif
+#ifdef HAVE_QUANT_KERNELS
+#include <immintrin.h>
+#endif
+
+#include "matmul-internal.h"
+
+// startup information for a single worker thread.
+typedef struct pool_worker
+{
+  Pool *pool;
+  int id;
+} PoolWorker;
+
+// one node of the divide-and-conquer multiply: C (+)= A*B for an m x k by k x n
+// block.  pending, if set, is the spawning node's count of unfinished children.
+typedef struct task
+{
+  int type;
+  int m, n, k;
+  const void *a;
+  const void *b;
+  void *c;
+  int lda, ldb, ldc;
+  int accumulate;
+  int *pending;
+} Task;
+
+// a worker's tasks.  The owner pushes and pops the newest at bottom, thieves take
+// the oldest (and so largest) from top.  Indices only grow and wrap by DEQUE_SIZE.
+typedef struct deque
+{
+  pthread_mutex_t lock;
+  int top;
+  int bottom;
+  unsigned int seed;
+  Task tasks[DEQUE_SIZE];
+} Deque;
+
+// computes count products of one shape; m, n and k are ignored by kernels compiled
+// for a fixed shape.
+typedef void (*BatchKernel)(const Triple *batch, int count, int m, int n, int k, int lda,
+                            int ldb, int ldc);
+
+typedef struct small_kernel
+{
+  int type;
+  int m, n, k;
+  BatchKernel fn;
+} SmallKernel;
+
+// shared state of one gemm_batch call.
+typedef struct batch_job
+{
+  const Triple *batch;
+  int count;
+  int m, n, k;
+  int lda, ldb, ldc;
+  BatchKernel fn;
+  int next;
+} BatchJob;
+
+// shared state of one gemm_steal call.
+typedef struct steal
+{
+  int nthreads;
+  int strassen;
+  Deque *deques;
+  Task root;
+  volatile int done;
+} Steal;
+
+void pool_place(Pool *pool);
+int numa_topology(int *cpus, int *nodes, int max);
+void touch_worker(void *arg, int id);
+void *pool_thread(void *param);
+
+int check_args(int type, int m, int n, int k, int lda, int ldb, int ldc);
+
+void gemm_partition(Pool *pool, Gemm *g);
+void gemm_worker(void *arg, int id);
+void gemm_tile_i32(const Gemm *g, int i0, int i1, int j0, int j1);
+void gemm_tile_f32(const Gemm *g, int i0, int i1, int j0, int j1);
+void gemm_tile_quant(const Gemm *g, int i0, int i1, int j0, int j1);
+void pack_worker(void *arg, int id);
+void steal_worker(void *arg, int id);
+void dc_run(Steal *s, int id, const Task *t);
+int dc_split(int len);
+void dc_leaf(const Task *t);
+void dc_strassen(Steal *s, int id, const Task *t);
+void dc_spawn(Steal *s, int id, const Task *t, int *pending);
+void dc_sync(Steal *s, int id, int *pending);
+int dc_find(Steal *s, int id, Task *t);
+void *block_alloc(int type, int rows, int cols);
+void block_zero(int type, int rows, int cols, void *c, int ldc);
+void block_copy(int type, int rows, int cols, const void *x, int ldx, void *c, int ldc);
+void block_axpy(int type, int rows, int cols, int scale, const void *x, int ldx,
+                void *c, int ldc);
+
+void batch_worker(void *arg, int id);
+void small_generic_i32(const Triple *batch, int count, int m, int n, int k, int lda,
+                       int ldb, int ldc);
+void small_generic_f32(const Triple *batch, int count, int m, int n, int k, int lda,
+                       int ldb, int ldc);
+
+void axpy_i32_scalar(int *c, int a, const int *b, int n);
+void axpy_f32_scalar(float *c, float a, const float *b, int n);
+void dot_i16_scalar(int *c, int a, const int *b, int n);
+void dot_i8_scalar(int *c, int a, const int *b, int n);
+
+Kernels kern;
+QuantKernels qkern;
+
+// Strassen's seven products M[i] = (A[x] + s*A[y]) * (B[u] + t*B[v]) over the
+// quadrants 0=11, 1=12, 2=21, 3=22, stored as {x, y, s} and {u, v, t} (s = 0 means
+// no second term), and the coefficient of each M[i] in each quadrant of C.
+const int strassen_a[7][3] = { {0,3,1}, {2,3,1}, {0,0,0}, {3,0,0}, {0,1,1}, {2,0,-1}, {1,3,-1} };
+const int strassen_b[7][3] = { {0,3,1}, {0,0,0}, {1,3,-1}, {2,0,-1}, {3,0,0}, {0,1,1}, {2,3,1} };
+const int strassen_c[4][7] = { {1,0,0,1,-1,0,1}, {0,0,1,0,1,0,0},
+                               {0,1,0,1,0,0,0}, {1,-1,1,0,0,1,0} };
+
+/*
+ *
+ * Create a context with nthreads workers, pinned if flags has MATMUL_PIN.  The first
+ * context also picks the fastest kernels this CPU supports, unless matmul_set_kernels
+ * already picked some.  Returns NULL if nthreads is less than 1.
+ *
+ */
+matmul_ctx *matmul_create(int nthreads, int flags)
+{
+  if (nthreads < 1)
+    return NULL;
+
+  if (kern.name == NULL)
+    select_kernels(NULL);
+
+  return pool_create(nthreads, flags & MATMUL_PIN);
+}
+
+/*
+ *
+ * Stop the workers of ctx and free it.
+ *
+ */
+void matmul_free(matmul_ctx *ctx)
+{
+  pool_destroy(ctx);
+}
+
+/*
+ *
+ * Number of worker threads in ctx.
+ *
+ */
+int matmul_threads(const matmul_ctx *ctx)
+{
+  return ctx->nthreads;
+}
+
+/*
+ *
+ * Use the named kernels (scalar, sse4.1, avx2 or avx512) for every later multiply in
+ * the process, or the fastest supported ones if name is NULL.  Returns -1, keeping
+ * the current kernels, if the name is unknown or this CPU cannot run them.
+ *
+ */
+int matmul_set_kernels(const char *name)
+{
+  return select_kernels(name);
+}
+
+/*
+ *
+ * Name of the kernels in use.
+ *
+ */
+const char *matmul_kernels(void)
+{
+  if (kern.name == NULL)
+    select_kernels(NULL);
+
+  return kern.name;
+}
+
+/*
+ *
+ * Return 0 if type is a matmul type and an m x k by k x n product with the given
+ * leading dimensions is well formed, and -1 otherwise.
+ *
+ */
+int check_args(int type, int m, int n, int k, int lda, int ldb, int ldc)
+{
+  if (type != MAT_INT32 && type != MAT_FLOAT32)
+    return -1;
+
+  if (m < 0 || n < 0 || k < 0 || lda < k || ldb < n || ldc < n)
+    return -1;
+
+  return 0;
+}
+
+/*
+ *
+ * C = A*B, split into tiles over the workers of ctx.  A is m x k, B is k x n and C is
+ * m x n.
+ *
+ */
+int matmul_multiply(matmul_ctx *ctx, int type, int m, int n, int k, const void *a, int lda,
+                    const void *b, int ldb, void *c, int ldc)
+{
+  if (check_args(type, m, n, k, lda, ldb, ldc))
+    return -1;
+
+  // nothing to compute, and the tiling divides by the width of C.
+  if (m == 0 || n == 0)
+    return 0;
+
+  gemm_pool(ctx, type, m, n, k, a, lda, b, ldb, c, ldc);
+  return 0;
+}
+
+/*
+ *
+ * C = A*B by recursive splitting with work stealing, which balances better than
+ * fixed tiles on uneven machines.  With strassen set, large square-ish blocks use
+ * Strassen's seven products (faster, but float results differ in rounding).
+ *
+ */
+int matmul_multiply_steal(matmul_ctx *ctx, int type, int m, int n, int k, const void *a,
+                          int lda, const void *b, int ldb, void *c, int ldc, int strassen)
+{
+  if (check_args(type, m, n, k, lda, ldb, ldc))
+    return -1;
+
+  if (m == 0 || n == 0)
+    return 0;
+
+  gemm_steal(ctx, type, m, n, k, a, lda, b, ldb, c, ldc, strassen);
+  return 0;
+}
+
+/*
+ *
+ * Copy the k x n matrix B into column panels, for multiplying many A by the same B.
+ * Returns NULL for invalid arguments.
+ *
+ */
+matmul_packed *matmul_pack(matmul_ctx *ctx, int type, int k, int n, const void *b, int ldb)
+{
+  PackedB *pb;
+
+  if (check_args(type, 0, n, k, k, ldb, n) || k == 0 || n == 0)
+    return NULL;
+
+  pb = malloc(sizeof(PackedB));
+  if (pb == NULL)
+  {
+    perror("[ERROR]");
+    exit(EXIT_FAILURE);
+  }
+
+  pack_b(ctx, pb, type, k, n, b, ldb);
+  return pb;
+}
+
+/*
+ *
+ * C = A*B for a B packed by matmul_pack.  A is m x b->k and C is m x b->n.
+ *
+ */
+int matmul_multiply_packed(matmul_ctx *ctx, int m, const void *a, int lda,
+                           const matmul_packed *b, void *c, int ldc)
+{
+  if (check_args(b->type, m, b->n, b->k, lda, b->n, ldc))
+    return -1;
+
+  if (m == 0)
+    return 0;
+
+  gemm_packed(ctx, m, a, lda, b, c, ldc);
+  return 0;
+}
+
+/*
+ *
+ * Free a B packed by matmul_pack.
+ *
+ */
+void matmul_free_packed(matmul_packed *b)
+{
+  free_packed(b);
+  free(b);
+}
+
+/*
+ *
+ * count independent products of one m x k by k x n shape, spread over the workers.
+ * Meant for many small matrices, where common shapes use fixed-size kernels.
+ *
+ */
+int matmul_multiply_batch(matmul_ctx *ctx, int type, int m, int n, int k,
+                          const matmul_triple *batch, int count, int lda, int ldb, int ldc)
+{
+  if (check_args(type, m, n, k, lda, ldb, ldc) || count < 0)
+    return -1;
+
+  if (m == 0 || n == 0 || count == 0)
+    return 0;
+
+  gemm_batch(ctx, type, m, n, k, batch, count, lda, ldb, ldc);
+  return 0;
+}
+
+/*
+ *
+ * Zero a rows x cols matrix from the workers that will compute each of its rows, so
+ * that on a pinned context every page of a freshly allocated C lands on the node
+ * that writes it.
+ *
+ */
+int matmul_touch(matmul_ctx *ctx, int type, int rows, int cols, void *c, int ldc)
+{
+  if (check_args(type, rows, cols, 0, 0, cols, ldc))
+    return -1;
+
+  if (rows == 0 || cols == 0)
+    return 0;
+
+  numa_touch(ctx, type, rows, cols, c, ldc);
+  return 0;
+}
+
+/*
+ *
+ * Create a pool of nthreads workers.  The workers sleep until a job is posted with
+ * pool_run, and stay alive until pool_destroy so repeated jobs pay no thread creation.
+ * If pin is set each worker binds itself to the CPU chosen by pool_place.
+ *
+ */
+Pool *pool_create(int nthreads, int pin)
+{
+  Pool *pool = calloc(1, sizeof(Pool));
+  PoolWorker *workers;
+  int i;
+
+  workers = malloc(nthreads * sizeof(PoolWorker));
+  if (pool == NULL || workers == NULL)
+  {
+    perror("[ERROR]");
+    exit(EXIT_FAILURE);
+  }
+
+  pool->nthreads = nthreads;
+  pool->tid = malloc(nthreads * sizeof(pthread_t));
+  pool->cpu = malloc(nthreads * sizeof(int));
+  pool->node = calloc(nthreads, sizeof(int));
+  if (pool->tid == NULL || pool->cpu == NULL || pool->node == NULL)
+  {
+    perror("[ERROR]");
+    exit(EXIT_FAILURE);
+  }
+
+  if (pin)
+    pool_place(pool);
+  else
+  {
+    for (i=0; i<nthreads; i++)
+      pool->cpu[i] = -1;
+    pool->nnodes = 1;
+    pool->node_workers[0] = nthreads;
+  }
+
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->work_cv, NULL);
+  pthread_cond_init(&pool->done_cv, NULL);
+
+  for (i=0; i<nthreads; i++)
+  {
+    workers[i].pool = pool;
+    workers[i].id = i;
+    int rc = pthread_create(&pool->tid[i], NULL, pool_thread, (void *) &workers[i]);
+    if (rc)
+    {
+      perror("[ERROR]");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  // wait for every worker to copy its startup information before releasing it.
+  pthread_mutex_lock(&pool->lock);
+  while (pool->pending < nthreads)
+    pthread_cond_wait(&pool->done_cv, &pool->lock);
+  pool->pending = 0;
+  pthread_mutex_unlock(&pool->lock);
+
+  free(workers);
+  return pool;
+}
+
+/*
+ *
+ * Run job(arg, id) once on every worker in the pool and return when all of them
+ * have finished.  The job is responsible for dividing the work among the workers.
+ *
+ */
+void pool_run(Pool *pool, void (*job)(void *arg, int id), void *arg)
+{
+  pthread_mutex_lock(&pool->lock);
+  pool->job = job;
+  pool->arg = arg;
+  pool->pending = pool->nthreads;
+  pool->generation++;
+  pthread_cond_broadcast(&pool->work_cv);
+
+  while (pool->pending > 0)
+    pthread_cond_wait(&pool->done_cv, &pool->lock);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ *
+ * Stop and join all of the workers, then release the pool.
+ *
+ */
+void pool_destroy(Pool *pool)
+{
+  int i;
+
+  pthread_mutex_lock(&pool->lock);
+  pool->shutdown = 1;
+  pthread_cond_broadcast(&pool->work_cv);
+  pthread_mutex_unlock(&pool->lock);
+
+  for (i=0; i<pool->nthreads; i++)
+  {
+    int rc = pthread_join(pool->tid[i], NULL);
+    if (rc)
+    {
+      printf("[ERROR]: return code from pthread_join is %d", rc);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  pthread_cond_destroy(&pool->work_cv);
+  pthread_cond_destroy(&pool->done_cv);
+  pthread_mutex_destroy(&pool->lock);
+  free(pool->tid);
+  free(pool->cpu);
+  free(pool->node);
+  free(pool);
+}
+
+/*
+ *
+ * Worker thread body: wait for a new job generation, run it, and report completion.
+ *
+ */
+void *pool_thread(void *param)
+{
+  PoolWorker *worker = (PoolWorker *) param;
+  Pool *pool = worker->pool;
+  const int id = worker->id;
+  unsigned long seen = 0;
+  cpu_set_t set;
+
+  if (pool->cpu[id] >= 0)
+  {
+    CPU_ZERO(&set);
+    CPU_SET(pool->cpu[id], &set);
+    if (sched_setaffinity(0, sizeof(set), &set) == -1)
+      perror("[ERROR]");
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  pool->pending++;
+  pthread_cond_signal(&pool->done_cv);
+
+  while (1)
+  {
+    while (!pool->shutdown && pool->generation == seen)
+      pthread_cond_wait(&pool->work_cv, &pool->lock);
+
+    if (pool->shutdown)
+      break;
+
+    seen = pool->generation;
+    pthread_mutex_unlock(&pool->lock);
+
+    pool->job(pool->arg, id);
+
+    pthread_mutex_lock(&pool->lock);
+    if (--pool->pending == 0)
+      pthread_cond_signal(&pool->done_cv);
+  }
+
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+/*
+ *
+ * Read the CPUs of each NUMA node from sysfs into cpus (grouped by node, with the
+ * node of each in nodes) and return how many there are.  Without sysfs node
+ * information every online CPU is reported on node 0.
+ *
+ */
+int numa_topology(int *cpus, int *nodes, int max)
+{
+  char path[64], list[1024];
+  char *range, *save;
+  int node, lo, hi, count = 0;
+  FILE *fp;
+
+  for (node=0; node<MAX_NODES; node++)
+  {
+    sprintf(path, "/sys/devices/system/node/node%d/cpulist", node);
+    if ((fp = fopen(path, "r")) == NULL)
+      continue;
+
+    if (fgets(list, sizeof(list), fp) == NULL)
+      list[0] = '\0';
+    fclose(fp);
+
+    // cpulist is a comma-separated list of single CPUs and lo-hi ranges.
+    for (range=strtok_r(list, ",\n", &save); range!=NULL; range=strtok_r(NULL, ",\n", &save))
+    {
+      if (sscanf(range, "%d-%d", &lo, &hi) != 2)
+        hi = lo = atoi(range);
+
+      for (; lo<=hi && count<max; lo++, count++)
+      {
+        cpus[count] = lo;
+        nodes[count] = node;
+      }
+    }
+  }
+
+  if (count > 0)
+    return count;
+
+  for (count=0; count<max && count<sysconf(_SC_NPROCESSORS_ONLN); count++)
+  {
+    cpus[count] = count;
+    nodes[count] = 0;
+  }
+
+  return count;
+}
+
+/*
+ *
+ * Choose a CPU for every worker of the pool, taking one CPU from each node in turn so
+ * the workers are spread evenly over the nodes, and number the nodes in use densely.
+ * More workers than CPUs wrap around onto the same CPUs.
+ *
+ */
+void pool_place(Pool *pool)
+{
+  int cpus[MAX_CPUS], nodes[MAX_CPUS], used[MAX_CPUS];
+  int dense[MAX_NODES];
+  const int ncpus = numa_topology(cpus, nodes, MAX_CPUS);
+  int w, c, node = 0, tries;
+
+  memset(used, 0, sizeof(used));
+  for (node=0; node<MAX_NODES; node++)
+    dense[node] = -1;
+
+  node = 0;
+  for (w=0; w<pool->nthreads; w++)
+  {
+    if (w % ncpus == 0)
+      memset(used, 0, sizeof(used));
+
+    // next node (round robin) that still has an unused CPU.
+    for (tries=0, c=ncpus; tries<MAX_NODES && c==ncpus; tries++, node=(node+1)%MAX_NODES)
+      for (c=0; c<ncpus && (used[c] || nodes[c] != node); c++)
+        ;
+
+    used[c] = 1;
+    pool->cpu[w] = cpus[c];
+    if (dense[nodes[c]] < 0)
+      dense[nodes[c]] = pool->nnodes++;
+    pool->node[w] = dense[nodes[c]];
+    pool->node_workers[pool->node[w]]++;
+  }
+}
+
+/*
+ *
+ * Zero the rows x cols matrix c from the workers that will compute on it.  Rows are
+ * split among the nodes exactly as gemm_run splits the rows of C, so under the
+ * kernel's first-touch policy each node's rows of A and C end up in its own memory.
+ *
+ */
+void numa_touch(Pool *pool, int type, int rows, int cols, void *c, int ldc)
+{
+  Gemm g;
+
+  memset(&g, 0, sizeof(Gemm));
+  g.type = type;
+  g.m = rows;
+  g.n = cols;
+  g.c = c;
+  g.ldc = ldc;
+  g.tiles_n = 1;
+  g.ntiles = (g.m + TILE_M - 1) / TILE_M;
+  gemm_partition(pool, &g);
+
+  pool_run(pool, touch_worker, &g);
+}
+
+/*
+ *
+ * Pool job for numa_touch: zero the row blocks of the worker's own node.
+ *
+ */
+void touch_worker(void *arg, int id)
+{
+  Gemm *g = (Gemm *) arg;
+  const int node = g->node[id];
+  int t, i;
+
+  while ((t = __sync_fetch_and_add(&g->node_next[node], 1)) < g->node_end[node])
+  {
+    const int i0 = t * TILE_M;
+    const int i1 = (i0 + TILE_M < g->m) ? i0 + TILE_M : g->m;
+
+    for (i=i0; i<i1; i++)
+      memset(elem_at(g->c, g->type, i, g->ldc, 0), 0, g->n * type_size(g->type));
+  }
+}
+
+/*
+ *
+ * Compute C = A*B (m x k times k x n) on the worker pool.  Operands are row-major
+ * with leading dimensions lda, ldb and ldc, and C is overwritten.
+ *
+ */
+void gemm_pool(Pool *pool, int type, int m, int n, int k, const void *a, int lda,
+               const void *b, int ldb, void *c, int ldc)
+{
+  Gemm g;
+
+  g.type = type;
+  g.m = m;
+  g.n = n;
+  g.k = k;
+  g.a = a;
+  g.b = b;
+  g.c = c;
+  g.lda = lda;
+  g.ldb = ldb;
+  g.ldc = ldc;
+  g.panel_stride = TILE_N;
+  g.accumulate = 0;
+
+  gemm_run(pool, &g);
+}
+
+/*
+ *
+ * Compute C = A*B on the worker pool, with B already packed by pack_b.  A is m x pb->k
+ * with leading dimension lda, and C (m x pb->n, leading dimension ldc) is overwritten.
+ *
+ */
+void gemm_packed(Pool *pool, int m, const void *a, int lda, const PackedB *pb,
+                 void *c, int ldc)
+{
+  Gemm g;
+
+  g.type = pb->type;
+  g.m = m;
+  g.n = pb->n;
+  g.k = pb->k;
+  g.a = a;
+  g.b = pb->data;
+  g.c = c;
+  g.lda = lda;
+  g.ldb = pb->width;
+  g.ldc = ldc;
+  g.panel_stride = (size_t) pb->k * pb->width;
+  g.accumulate = 0;
+
+  gemm_run(pool, &g);
+}
+
+/*
+ *
+ * Split the product described by g into tiles and run them on the pool.
+ *
+ */
+void gemm_run(Pool *pool, Gemm *g)
+{
+  g->tiles_n = (g->n + TILE_N - 1) / TILE_N;
+  g->ntiles = ((g->m + TILE_M - 1) / TILE_M) * g->tiles_n;
+  gemm_partition(pool, g);
+
+  pool_run(pool, gemm_worker, g);
+}
+
+/*
+ *
+ * Give each node of the pool a contiguous run of whole tile rows of C, in proportion
+ * to its number of workers.  An unpinned pool is a single node owning every tile.
+ *
+ */
+void gemm_partition(Pool *pool, Gemm *g)
+{
+  const int tile_rows = g->ntiles / g->tiles_n;
+  int node, row = 0, workers = 0;
+
+  g->node = pool->node;
+  g->nnodes = pool->nnodes;
+  g->stolen = 0;
+
+  for (node=0; node<g->nnodes; node++)
+  {
+    workers += pool->node_workers[node];
+    g->node_next[node] = row * g->tiles_n;
+    row = (int) ((long) tile_rows * workers / pool->nthreads);
+    g->node_end[node] = row * g->tiles_n;
+  }
+}
+
+/*
+ *
+ * Compute C = A*B by recursive divide and conquer on per-worker work-stealing deques.
+ * Each node splits the longest of m, n and k in half until the block is small enough
+ * for gemm_tile, and idle workers steal the oldest pending halves from the others, so
+ * tall, wide and deep shapes all keep every worker busy.  Blocks whose dimensions are
+ * all even and at least strassen use Strassen's seven-product step instead (0 turns
+ * Strassen off).  Operands are row-major with leading dimensions; C is overwritten.
+ *
+ */
+void gemm_steal(Pool *pool, int type, int m, int n, int k, const void *a, int lda,
+                const void *b, int ldb, void *c, int ldc, int strassen)
+{
+  Steal s;
+  int i;
+
+  memset(&s, 0, sizeof(Steal));
+  s.nthreads = pool->nthreads;
+  s.strassen = strassen;
+  s.deques = calloc(s.nthreads, sizeof(Deque));
+  if (s.deques == NULL)
+  {
+    perror("[ERROR]");
+    exit(EXIT_FAILURE);
+  }
+
+  for (i=0; i<s.nthreads; i++)
+    pthread_mutex_init(&s.deques[i].lock, NULL);
+
+  s.root.type = type;
+  s.root.m = m;
+  s.root.n = n;
+  s.root.k = k;
+  s.root.a = a;
+  s.root.b = b;
+  s.root.c = c;
+  s.root.lda = lda;
+  s.root.ldb = ldb;
+  s.root.ldc = ldc;
+
+  pool_run(pool, steal_worker, &s);
+
+  for (i=0; i<s.nthreads; i++)
+    pthread_mutex_destroy(&s.deques[i].lock);
+  free(s.deques);
+}
+
+/*
+ *
+ * Pool job for gemm_steal: worker 0 runs the root task, and every worker steals and
+ * runs tasks until the root has finished.
+ *
+ */
+void steal_worker(void *arg, int id)
+{
+  Steal *s = (Steal *) arg;
+  Task t;
+
+  if (id == 0)
+  {
+    dc_run(s, id, &s->root);
+    __sync_synchronize();
+    s->done = 1;
+    return;
+  }
+
+  while (!s->done)
+  {
+    if (dc_find(s, id, &t))
+      dc_run(s, id, &t);
+    else
+      sched_yield();
+  }
+}
+
+/*
+ *
+ * Run one task to completion on worker id, spawning halves for other workers to steal.
+ * Splitting k runs the halves one after the other, since both add into the same C.
+ *
+ */
+void dc_run(Steal *s, int id, const Task *t)
+{
+  Task lo = *t, hi = *t;
+  int pending = 0;
+
+  lo.pending = NULL;
+  hi.pending = NULL;
+
+  if ((size_t) t->m * t->n * t->k <= DC_LEAF ||
+      (t->m <= DC_MIN && t->n <= DC_MIN && t->k <= DC_MIN))
+    dc_leaf(t);
+  else if (s->strassen > 0 && t->m >= s->strassen && t->n >= s->strassen &&
+           t->k >= s->strassen && t->m % 2 == 0 && t->n % 2 == 0 && t->k % 2 == 0)
+    dc_strassen(s, id, t);
+  else if (t->m >= t->n && t->m >= t->k)
+  {
+    lo.m = dc_split(t->m);
+    hi.m = t->m - lo.m;
+    hi.a = elem_at(t->a, t->type, lo.m, t->lda, 0);
+    hi.c = elem_at(t->c, t->type, lo.m, t->ldc, 0);
+    dc_spawn(s, id, &hi, &pending);
+    dc_run(s, id, &lo);
+    dc_sync(s, id, &pending);
+  }
+  else if (t->n >= t->k)
+  {
+    lo.n = dc_split(t->n);
+    hi.n = t->n - lo.n;
+    hi.b = elem_at(t->b, t->type, 0, t->ldb, lo.n);
+    hi.c = elem_at(t->c, t->type, 0, t->ldc, lo.n);
+    dc_spawn(s, id, &hi, &pending);
+    dc_run(s, id, &lo);
+    dc_sync(s, id, &pending);
+  }
+  else
+  {
+    lo.k = dc_split(t->k);
+    hi.k = t->k - lo.k;
+    hi.a = elem_at(t->a, t->type, 0, t->lda, lo.k);
+    hi.b = elem_at(t->b, t->type, lo.k, t->ldb, 0);
+    hi.accumulate = 1;
+    dc_run(s, id, &lo);
+    dc_run(s, id, &hi);
+  }
+
+  if (t->pending != NULL)
+    __sync_fetch_and_sub(t->pending, 1);
+}
+
+/*
+ *
+ * Where to split a dimension of length len: near the middle, but on a multiple of
+ * DC_ALIGN when possible so leaf rows stay a whole number of SIMD vectors.
+ *
+ */
+int dc_split(int len)
+{
+  const int half = (len / 2 + DC_ALIGN - 1) / DC_ALIGN * DC_ALIGN;
+
+  return (half < len) ? half : len / 2;
+}
+
+/*
+ *
+ * Compute a leaf block with the tile loops, adding into C if the task accumulates.
+ *
+ */
+void dc_leaf(const Task *t)
+{
+  Gemm g;
+
+  g.type = t->type;
+  g.m = t->m;
+  g.n = t->n;
+  g.k = t->k;
+  g.a = t->a;
+  g.b = t->b;
+  g.c = t->c;
+  g.lda = t->lda;
+  g.ldb = t->ldb;
+  g.ldc = t->ldc;
+  g.panel_stride = TILE_N;
+  g.accumulate = t->accumulate;
+
+  if (t->type == MAT_INT32)
+    gemm_tile_i32(&g, 0, t->m, 0, t->n);
+  else
+    gemm_tile_f32(&g, 0, t->m, 0, t->n);
+}
+
+/*
+ *
+ * One Strassen step: form the operand sums, spawn the seven half-size products, wait
+ * for them, and combine them into the four quadrants of C.
+ *
+ */
+void dc_strassen(Steal *s, int id, const Task *t)
+{
+  const int hm = t->m / 2, hn = t->n / 2, hk = t->k / 2;
+  const int type = t->type;
+  const void *aq[4], *bq[4];
+  void *cq[4];
+  void *sa[7], *sb[7], *prod[7];
+  Task sub[7];
+  int pending = 0;
+  int i, q;
+
+  aq[0] = t->a;
+  aq[1] = elem_at(t->a, type, 0, t->lda, hk);
+  aq[2] = elem_at(t->a, type, hm, t->lda, 0);
+  aq[3] = elem_at(t->a, type, hm, t->lda, hk);
+  bq[0] = t->b;
+  bq[1] = elem_at(t->b, type, 0, t->ldb, hn);
+  bq[2] = elem_at(t->b, type, hk, t->ldb, 0);
+  bq[3] = elem_at(t->b, type, hk, t->ldb, hn);
+  cq[0] = t->c;
+  cq[1] = elem_at(t->c, type, 0, t->ldc, hn);
+  cq[2] = elem_at(t->c, type, hm, t->ldc, 0);
+  cq[3] = elem_at(t->c, type, hm, t->ldc, hn);
+
+  for (i=0; i<7; i++)
+  {
+    sub[i].type = type;
+    sub[i].m = hm;
+    sub[i].n = hn;
+    sub[i].k = hk;
+    sub[i].accumulate = 0;
+    sub[i].pending = NULL;
+
+    // an operand with no second term is used in place.
+    sa[i] = NULL;
+    sub[i].a = aq[strassen_a[i][0]];
+    sub[i].lda = t->lda;
+    if (strassen_a[i][2])
+    {
+      sa[i] = block_alloc(type, hm, hk);
+      block_copy(type, hm, hk, aq[strassen_a[i][0]], t->lda, sa[i], hk);
+      block_axpy(type, hm, hk, strassen_a[i][2], aq[strassen_a[i][1]], t->lda, sa[i], hk);
+      sub[i].a = sa[i];
+      sub[i].lda = hk;
+    }
+
+    sb[i] = NULL;
+    sub[i].b = bq[strassen_b[i][0]];
+    sub[i].ldb = t->ldb;
+    if (strassen_b[i][2])
+    {
+      sb[i] = block_alloc(type, hk, hn);
+      block_copy(type, hk, hn, bq[strassen_b[i][0]], t->ldb, sb[i], hn);
+      block_axpy(type, hk, hn, strassen_b[i][2], bq[strassen_b[i][1]], t->ldb, sb[i], hn);
+      sub[i].b = sb[i];
+      sub[i].ldb = hn;
+    }
+
+    prod[i] = block_alloc(type, hm, hn);
+    sub[i].c = prod[i];
+    sub[i].ldc = hn;
+
+    if (i < 6)
+      dc_spawn(s, id, &sub[i], &pending);
+  }
+
+  dc_run(s, id, &sub[6]);
+  dc_sync(s, id, &pending);
+
+  for (q=0; q<4; q++)
+  {
+    if (!t->accumulate)
+      block_zero(type, hm, hn, cq[q], t->ldc);
+
+    for (i=0; i<7; i++)
+      if (strassen_c[q][i])
+        block_axpy(type, hm, hn, strassen_c[q][i], prod[i], hn, cq[q], t->ldc);
+  }
+
+  for (i=0; i<7; i++)
+  {
+    free(sa[i]);
+    free(sb[i]);
+    free(prod[i]);
+  }
+}
+
+/*
+ *
+ * Make a task available to thieves.  The caller's pending counter is raised first and
+ * dropped by whichever worker finishes the task.  A full deque runs the task inline.
+ *
+ */
+void dc_spawn(Steal *s, int id, const Task *t, int *pending)
+{
+  Deque *d = &s->deques[id];
+  Task child = *t;
+
+  child.pending = pending;
+  __sync_fetch_and_add(pending, 1);
+
+  pthread_mutex_lock(&d->lock);
+  if (d->bottom - d->top < DEQUE_SIZE)
+  {
+    d->tasks[d->bottom % DEQUE_SIZE] = child;
+    d->bottom++;
+    pthread_mutex_unlock(&d->lock);
+    return;
+  }
+  pthread_mutex_unlock(&d->lock);
+
+  dc_run(s, id, &child);
+}
+
+/*
+ *
+ * Wait for every task spawned against pending, running other tasks in the meantime.
+ *
+ */
+void dc_sync(Steal *s, int id, int *pending)
+{
+  Task t;
+
+  while (*(volatile int *) pending > 0)
+  {
+    if (dc_find(s, id, &t))
+      dc_run(s, id, &t);
+    else
+      sched_yield();
+  }
+
+  __sync_synchronize();
+}
+
+/*
+ *
+ * Find a task for worker id: the newest task on its own deque, or else the oldest
+ * task on another worker's deque, starting from a random victim.  Returns 0 if every
+ * deque is empty.
+ *
+ */
+int dc_find(Steal *s, int id, Task *t)
+{
+  Deque *d = &s->deques[id];
+  int i, start, found = 0;
+
+  pthread_mutex_lock(&d->lock);
+  if (d->bottom > d->top)
+  {
+    d->bottom--;
+    *t = d->tasks[d->bottom % DEQUE_SIZE];
+    found = 1;
+  }
+  pthread_mutex_unlock(&d->lock);
+
+  if (found)
+    return 1;
+
+  d->seed = d->seed * 1103515245 + 12345 + id;
+  start = (d->seed >> 16) % s->nthreads;
+
+  for (i=0; i<s->nthreads && !found; i++)
+  {
+    Deque *victim = &s->deques[(start + i) % s->nthreads];
+
+    // unlocked peek, so idle workers do not hammer the locks of empty deques.
+    if (victim == d || *(volatile int *) &victim->bottom == *(volatile int *) &victim->top)
+      continue;
+
+    pthread_mutex_lock(&victim->lock);
+    if (victim->bottom > victim->top)
+    {
+      *t = victim->tasks[victim->top % DEQUE_SIZE];
+      victim->top++;
+      found = 1;
+    }
+    pthread_mutex_unlock(&victim->lock);
+  }
+
+  return found;
+}
+
+/*
+ *
+ * Address of element (row, col) of a row-major block with leading dimension ld.
+ *
+ */
+void *elem_at(const void *base, int type, size_t row, int ld, size_t col)
+{
+  return (char *) base + (row * ld + col) * type_size(type);
+}
+
+/*
+ *
+ * Allocate an uninitialized rows x cols block for Strassen temporaries.
+ *
+ */
+void *block_alloc(int type, int rows, int cols)
+{
+  void *block = malloc((size_t) rows * cols * type_size(type));
+
+  if (block == NULL)
+  {
+    perror("[ERROR]");
+    exit(EXIT_FAILURE);
+  }
+
+  return block;
+}
+
+/*
+ *
+ * Zero a rows x cols block.
+ *
+ */
+void block_zero(int type, int rows, int cols, void *c, int ldc)
+{
+  int i;
+
+  for (i=0; i<rows; i++)
+    memset(elem_at(c, type, i, ldc, 0), 0, cols * type_size(type));
+}
+
+/*
+ *
+ * Copy a rows x cols block from x to c.
+ *
+ */
+void block_copy(int type, int rows, int cols, const void *x, int ldx, void *c, int ldc)
+{
+  int i;
+
+  for (i=0; i<rows; i++)
+    memcpy(elem_at(c, type, i, ldc, 0), elem_at(x, type, i, ldx, 0), cols * type_size(type));
+}
+
+/*
+ *
+ * c += scale * x over a rows x cols block, one axpy kernel call per row.
+ *
+ */
+void block_axpy(int type, int rows, int cols, int scale, const void *x, int ldx,
+                void *c, int ldc)
+{
+  int i;
+
+  for (i=0; i<rows; i++)
+  {
+    if (type == MAT_INT32)
+      kern.axpy_i32(elem_at(c, type, i, ldc, 0), scale, elem_at(x, type, i, ldx, 0), cols);
+    else
+      kern.axpy_f32(elem_at(c, type, i, ldc, 0), (float) scale, elem_at(x, type, i, ldx, 0),
+                    cols);
+  }
+}
+
+/*
+ *
+ * Pack the k x n row-major B (leading dimension ldb) into pb, copying the panels in
+ * parallel on the pool.  Release with free_packed.
+ *
+ */
+void pack_b(Pool *pool, PackedB *pb, int type, int k, int n, const void *b, int ldb)
+{
+  const size_t bytes = (size_t) k * ((n + TILE_N - 1) / TILE_N) *
+                       (n < TILE_N ? n : TILE_N) * type_size(type);
+
+  pb->type = type;
+  pb->k = k;
+  pb->n = n;
+  pb->width = n < TILE_N ? n : TILE_N;
+  pb->panels = (n + pb->width - 1) / pb->width;
+  pb->src = b;
+  pb->ld = ldb;
+  pb->next = 0;
+
+  if (posix_memalign(&pb->data, 64, bytes))
+  {
+    perror("[ERROR]");
+    exit(EXIT_FAILURE);
+  }
+
+  pool_run(pool, pack_worker, pb);
+}
+
+/*
+ *
+ * Pool job for pack_b: claim panels from the shared counter and copy them.
+ *
+ */
+void pack_worker(void *arg, int id)
+{
+  PackedB *pb = (PackedB *) arg;
+  const size_t esize = type_size(pb->type);
+  int p, x;
+
+  (void) id;
+
+  while ((p = __sync_fetch_and_add(&pb->next, 1)) < pb->panels)
+  {
+    const int j0 = p * pb->width;
+    const int cols = (j0 + pb->width < pb->n) ? pb->width : pb->n - j0;
+    char *dst = (char *) pb->data + (size_t) p * pb->k * pb->width * esize;
+    const char *src = (const char *) pb->src + j0 * esize;
+
+    for (x=0; x<pb->k; x++)
+    {
+      memcpy(dst, src + (size_t) x * pb->ld * esize, cols * esize);
+      memset(dst + cols * esize, 0, (pb->width - cols) * esize);
+      dst += pb->width * esize;
+    }
+  }
+}
+
+/*
+ *
+ * Release the panels of a PackedB.
+ *
+ */
+void free_packed(PackedB *pb)
+{
+  free(pb->data);
+  pb->data = NULL;
+}
+
+/*
+ *
+ * Pool job for gemm_run: claim tiles of C from the worker's own node until they run
+ * out, then help the other nodes with theirs.
+ *
+ */
+void gemm_worker(void *arg, int id)
+{
+  Gemm *g = (Gemm *) arg;
+  const int home = g->node[id];
+  int node, s, t;
+
+  for (s=0; s<g->nnodes; s++)
+  {
+    node = (home + s) % g->nnodes;
+
+    while ((t = __sync_fetch_and_add(&g->node_next[node], 1)) < g->node_end[node])
+    {
+      if (s > 0)
+        __sync_fetch_and_add(&g->stolen, 1);
+
+      gemm_tile(g, t);
+    }
+  }
+}
+
+/*
+ *
+ * Compute tile t of C.
+ *
+ */
+void gemm_tile(const Gemm *g, int t)
+{
+  const int i0 = (t / g->tiles_n) * TILE_M;
+  const int j0 = (t % g->tiles_n) * TILE_N;
+  const int i1 = (i0 + TILE_M < g->m) ? i0 + TILE_M : g->m;
+  const int j1 = (j0 + TILE_N < g->n) ? j0 + TILE_N : g->n;
+
+  if (g->type == MAT_INT32)
+    gemm_tile_i32(g, i0, i1, j0, j1);
+  else if (g->type == MAT_FLOAT32)
+    gemm_tile_f32(g, i0, i1, j0, j1);
+  else
+    gemm_tile_quant(g, i0, i1, j0, j1);
+}
+
+/*
+ *
+ * Compute rows i0..i1 and columns j0..j1 of an int32 C, or add to them if the
+ * product accumulates.  The innermost loop runs
+ * along a row of the B panel and of C so both are read with unit stride by the axpy
+ * kernel.
+ *
+ */
+void gemm_tile_i32(const Gemm *g, int i0, int i1, int j0, int j1)
+{
+  const int *a = (const int *) g->a;
+  const int *bpanel = (const int *) g->b + (j0 / TILE_N) * g->panel_stride;
+  int *c = (int *) g->c;
+  int i, x, k0;
+
+  if (!g->accumulate)
+    for (i=i0; i<i1; i++)
+      memset(c + (size_t) i * g->ldc + j0, 0, (j1 - j0) * sizeof(int));
+
+  for (k0=0; k0<g->k; k0+=TILE_K)
+  {
+    const int k1 = (k0 + TILE_K < g->k) ? k0 + TILE_K : g->k;
+
+    for (i=i0; i<i1; i++)
+    {
+      int *crow = c + (size_t) i * g->ldc + j0;
+      const int *arow = a + (size_t) i * g->lda;
+
+      for (x=k0; x<k1; x++)
+        kern.axpy_i32(crow, arow[x], bpanel + (size_t) x * g->ldb, j1 - j0);
+    }
+  }
+}
+
+/*
+ *
+ * float32 version of gemm_tile_i32.
+ *
+ */
+void gemm_tile_f32(const Gemm *g, int i0, int i1, int j0, int j1)
+{
+  const float *a = (const float *) g->a;
+  const float *bpanel = (const float *) g->b + (j0 / TILE_N) * g->panel_stride;
+  float *c = (float *) g->c;
+  int i, x, k0;
+
+  if (!g->accumulate)
+    for (i=i0; i<i1; i++)
+      memset(c + (size_t) i * g->ldc + j0, 0, (j1 - j0) * sizeof(float));
+
+  for (k0=0; k0<g->k; k0+=TILE_K)
+  {
+    const int k1 = (k0 + TILE_K < g->k) ? k0 + TILE_K : g->k;
+
+    for (i=i0; i<i1; i++)
+    {
+      float *crow = c + (size_t) i * g->ldc + j0;
+      const float *arow = a + (size_t) i * g->lda;
+
+      for (x=k0; x<k1; x++)
+        kern.axpy_f32(crow, arow[x], bpanel + (size_t) x * g->ldb, j1 - j0);
+    }
+  }
+}
+
+/*
+ *
+ * Quantized version of gemm_tile_i32, for an int8 or int16 A and packed B.  k, lda and
+ * ldb count k-groups (see quant_b), each held in one int, and C is int32.
+ *
+ */
+void gemm_tile_quant(const Gemm *g, int i0, int i1, int j0, int j1)
+{
+  void (*dot)(int *c, int a, const int *b, int n) =
+    g->type == MAT_INT8 ? qkern.dot_i8 : qkern.dot_i16;
+  const int *a = (const int *) g->a;
+  const int *bpanel = (const int *) g->b + (j0 / TILE_N) * g->panel_stride;
+  int *c = (int *) g->c;
+  int i, x, k0;
+
+  if (!g->accumulate)
+    for (i=i0; i<i1; i++)
+      memset(c + (size_t) i * g->ldc + j0, 0, (j1 - j0) * sizeof(int));
+
+  for (k0=0; k0<g->k; k0+=TILE_K)
+  {
+    const int k1 = (k0 + TILE_K < g->k) ? k0 + TILE_K : g->k;
+
+    for (i=i0; i<i1; i++)
+    {
+      int *crow = c + (size_t) i * g->ldc + j0;
+      const int *arow = a + (size_t) i * g->lda;
+
+      for (x=k0; x<k1; x++)
+        dot(crow, arow[x], bpanel + (size_t) x * g->ldb, j1 - j0);
+    }
+  }
+}
+
+/*
+ *
+ * Define a small-product kernel.  With the shape fixed at compile time the loops
+ * unroll completely and the operands stay in registers; the shape and stride
+ * arguments are only used by the generic versions, which pass their own, while the
+ * fixed shapes assume dense operands.  The dot form computes each
+ * element of C in turn.  The row form builds each row of C as a sum of rows of B,
+ * which vectorizes when a row of C fills a SIMD register.
+ *
+ */
+#define DEFINE_SMALL_DOT(fn, type, M_, N_, K_, LDA_, LDB_, LDC_) \
+  void fn(const Triple *batch, int count, int m, int n, int k, int lda, int ldb, int ldc) \
+  { \
+    int t, i, j, x; \
+    (void) m; (void) n; (void) k; (void) lda; (void) ldb; (void) ldc; \
+    for (t=0; t<count; t++) \
+    { \
+      const type *a = (const type *) batch[t].a; \
+      const type *b = (const type *) batch[t].b; \
+      type *c = (type *) batch[t].c; \
+      for (i=0; i<(M_); i++) \
+        for (j=0; j<(N_); j++) \
+        { \
+          type sum = 0; \
+          for (x=0; x<(K_); x++) \
+            sum += a[i * (LDA_) + x] * b[x * (LDB_) + j]; \
+          c[i * (LDC_) + j] = sum; \
+        } \
+    } \
+  }
+
+#define DEFINE_SMALL_ROW(fn, type, M_, N_, K_) \
+  void fn(const Triple *batch, int count, int m, int n, int k, int lda, int ldb, int ldc) \
+  { \
+    int t, i, j, x; \
+    (void) m; (void) n; (void) k; (void) lda; (void) ldb; (void) ldc; \
+    for (t=0; t<count; t++) \
+    { \
+      const type *a = (const type *) batch[t].a; \
+      const type *b = (const type *) batch[t].b; \
+      type *c = (type *) batch[t].c; \
+      for (i=0; i<(M_); i++) \
+      { \
+        type row[N_]; \
+        for (j=0; j<(N_); j++) \
+          row[j] = 0; \
+        for (x=0; x<(K_); x++) \
+          for (j=0; j<(N_); j++) \
+            row[j] += a[i * (K_) + x] * b[x * (N_) + j]; \
+        for (j=0; j<(N_); j++) \
+          c[i * (N_) + j] = row[j]; \
+      } \
+    } \
+  }
+
+DEFINE_SMALL_DOT(small_generic_i32, int, m, n, k, lda, ldb, ldc)
+DEFINE_SMALL_DOT(small_generic_f32, float, m, n, k, lda, ldb, ldc)
+DEFINE_SMALL_DOT(small_i32_2x2x2, int, 2, 2, 2, 2, 2, 2)
+DEFINE_SMALL_DOT(small_i32_3x3x2, int, 3, 3, 2, 2, 3, 3)
+DEFINE_SMALL_DOT(small_i32_3x3x3, int, 3, 3, 3, 3, 3, 3)
+DEFINE_SMALL_ROW(small_i32_4x4x4, int, 4, 4, 4)
+DEFINE_SMALL_ROW(small_i32_8x8x8, int, 8, 8, 8)
+DEFINE_SMALL_DOT(small_f32_2x2x2, float, 2, 2, 2, 2, 2, 2)
+DEFINE_SMALL_DOT(small_f32_3x3x2, float, 3, 3, 2, 2, 3, 3)
+DEFINE_SMALL_DOT(small_f32_3x3x3, float, 3, 3, 3, 3, 3, 3)
+DEFINE_SMALL_ROW(small_f32_4x4x4, float, 4, 4, 4)
+DEFINE_SMALL_ROW(small_f32_8x8x8, float, 8, 8, 8)
+
+// shapes with a specialized kernel, as {type, m, n, k}.  3x3x2 is the built-in example.
+const SmallKernel small_kernels[] =
+{
+  { MAT_INT32, 2, 2, 2, small_i32_2x2x2 },
+  { MAT_INT32, 3, 3, 2, small_i32_3x3x2 },
+  { MAT_INT32, 3, 3, 3, small_i32_3x3x3 },
+  { MAT_INT32, 4, 4, 4, small_i32_4x4x4 },
+  { MAT_INT32, 8, 8, 8, small_i32_8x8x8 },
+  { MAT_FLOAT32, 2, 2, 2, small_f32_2x2x2 },
+  { MAT_FLOAT32, 3, 3, 2, small_f32_3x3x2 },
+  { MAT_FLOAT32, 3, 3, 3, small_f32_3x3x3 },
+  { MAT_FLOAT32, 4, 4, 4, small_f32_4x4x4 },
+  { MAT_FLOAT32, 8, 8, 8, small_f32_8x8x8 }
+};
+
+/*
+ *
+ * Compute C = A*B for every triple in batch, all of shape m x k times k x n with
+ * leading dimensions lda, ldb and ldc, spreading the batch over the pool BATCH_CHUNK
+ * products at a time.  Common shapes of dense operands use kernels compiled for that
+ * exact shape (see small_kernels); others use small_generic.
+ *
+ */
+void gemm_batch(Pool *pool, int type, int m, int n, int k, const Triple *batch, int count,
+                int lda, int ldb, int ldc)
+{
+  BatchJob job;
+  const int entries = sizeof(small_kernels) / sizeof(small_kernels[0]);
+  int i;
+
+  job.batch = batch;
+  job.count = count;
+  job.m = m;
+  job.n = n;
+  job.k = k;
+  job.lda = lda;
+  job.ldb = ldb;
+  job.ldc = ldc;
+  job.next = 0;
+  job.fn = (type == MAT_INT32) ? small_generic_i32 : small_generic_f32;
+
+  for (i=0; i<entries && lda == k && ldb == n && ldc == n; i++)
+    if (small_kernels[i].type == type && small_kernels[i].m == m &&
+        small_kernels[i].n == n && small_kernels[i].k == k)
+      job.fn = small_kernels[i].fn;
+
+  pool_run(pool, batch_worker, &job);
+}
+
+/*
+ *
+ * Pool job for gemm_batch: claim chunks of the batch from the shared counter.
+ *
+ */
+void batch_worker(void *arg, int id)
+{
+  BatchJob *job = (BatchJob *) arg;
+  int t;
+
+  (void) id;
+
+  while ((t = __sync_fetch_and_add(&job->next, BATCH_CHUNK)) < job->count)
+  {
+    const int count = (t + BATCH_CHUNK < job->count) ? BATCH_CHUNK : job->count - t;
+
+    job->fn(job->batch + t, count, job->m, job->n, job->k, job->lda, job->ldb, job->ldc);
+  }
+}
+
+/*
+ *
+ * Portable kernels, used when no SIMD implementation is supported.
+ *
+ */
+void axpy_i32_scalar(int *c, int a, const int *b, int n)
+{
+  int j;
+
+  for (j=0; j<n; j++)
+    c[j] += a * b[j];
+}
+
+void axpy_f32_scalar(float *c, float a, const float *b, int n)
+{
+  int j;
+
+  for (j=0; j<n; j++)
+    c[j] += a * b[j];
+}
+
+#ifdef HAVE_X86_KERNELS
+
+/*
+ *
+ * Define an axpy kernel for one instruction set: lanes elements at a time through a
+ * GCC vector type, then a scalar tail.  memcpy keeps the loads and stores unaligned.
+ *
+ */
+#define DEFINE_AXPY(fn, isa, type, lanes) \
+  typedef type fn##_vec __attribute__((vector_size((lanes) * sizeof(type)))); \
+  __attribute__((target(isa))) \
+  void fn(type *c, type a, const type *b, int n) \
+  { \
+    fn##_vec vb, vc; \
+    int j = 0; \
+    for (; j + (lanes) <= n; j += (lanes)) \
+    { \
+      memcpy(&vb, b + j, sizeof(vb)); \
+      memcpy(&vc, c + j, sizeof(vc)); \
+      vc += a * vb; \
+      memcpy(c + j, &vc, sizeof(vc)); \
+    } \
+    for (; j<n; j++) \
+      c[j] += a * b[j]; \
+  }
+
+DEFINE_AXPY(axpy_i32_sse41, "sse4.1", int, 4)
+DEFINE_AXPY(axpy_f32_sse41, "sse4.1", float, 4)
+DEFINE_AXPY(axpy_i32_avx2, "avx2", int, 8)
+DEFINE_AXPY(axpy_f32_avx2, "avx2", float, 8)
+#ifdef HAVE_AVX512_KERNELS
+DEFINE_AXPY(axpy_i32_avx512, "avx512f", int, 16)
+DEFINE_AXPY(axpy_f32_avx512, "avx512f", float, 16)
+#endif
+
+#endif
+
+// every kernel set built into this binary, fastest first.
+const Kernels kernel_table[] =
+{
+#ifdef HAVE_AVX512_KERNELS
+  { "avx512", CPU_AVX512F, axpy_i32_avx512, axpy_f32_avx512 },
+#endif
+#ifdef HAVE_X86_KERNELS
+  { "avx2", CPU_AVX2, axpy_i32_avx2, axpy_f32_avx2 },
+  { "sse4.1", CPU_SSE41, axpy_i32_sse41, axpy_f32_sse41 },
+#endif
+  { "scalar", 0, axpy_i32_scalar, axpy_f32_scalar }
+};
+
+/*
+ *
+ * Portable quantized kernels.  Each int of a and b holds one k-group: two int16, or
+ * four int8 of which b's are stored offset by 128 (see quant_b).  c[j] gets the dot
+ * product of a's group with the group b[j].
+ *
+ */
+void dot_i16_scalar(int *c, int a, const int *b, int n)
+{
+  int16_t x[2], y[2];
+  int j;
+
+  memcpy(x, &a, sizeof(x));
+
+  for (j=0; j<n; j++)
+  {
+    memcpy(y, b + j, sizeof(y));
+    c[j] += x[0] * y[0] + x[1] * y[1];
+  }
+}
+
+void dot_i8_scalar(int *c, int a, const int *b, int n)
+{
+  int8_t x[4];
+  uint8_t y[4];
+  int j;
+
+  memcpy(x, &a, sizeof(x));
+
+  for (j=0; j<n; j++)
+  {
+    memcpy(y, b + j, sizeof(y));
+    c[j] += x[0] * (y[0] - 128) + x[1] * (y[1] - 128) + x[2] * (y[2] - 128) +
+            x[3] * (y[3] - 128);
+  }
+}
+
+#ifdef HAVE_QUANT_KERNELS
+
+/*
+ *
+ * pmaddwd: multiply eight pairs of int16 and add each pair into an int32 lane.
+ *
+ */
+__attribute__((target("avx2")))
+void dot_i16_avx2(int *c, int a, const int *b, int n)
+{
+  const __m256i va = _mm256_set1_epi32(a);
+  __m256i vc;
+  int j = 0;
+
+  for (; j + 8 <= n; j += 8)
+  {
+    vc = _mm256_loadu_si256((const __m256i *) (c + j));
+    vc = _mm256_add_epi32(vc, _mm256_madd_epi16(va, _mm256_loadu_si256((const __m256i *) (b + j))));
+    _mm256_storeu_si256((__m256i *) (c + j), vc);
+  }
+
+  dot_i16_scalar(c + j, a, b + j, n - j);
+}
+
+/*
+ *
+ * AVX2 has no signed 8-bit dot product without saturation, so widen four groups at a
+ * time to int16, pmaddwd them against a's group, add the pair sums of each group with
+ * phaddd and put the groups back in order.  The 128 offset of b comes off at the end.
+ *
+ */
+__attribute__((target("avx2")))
+void dot_i8_avx2(int *c, int a, const int *b, int n)
+{
+  int8_t x[4];
+  __m256i va, vcorr, lo, hi, vc;
+  int j = 0;
+
+  memcpy(x, &a, sizeof(x));
+  va = _mm256_set1_epi64x((long long) ((uint16_t) x[0] | (uint64_t) (uint16_t) x[1] << 16 |
+                                       (uint64_t) (uint16_t) x[2] << 32 |
+                                       (uint64_t) (uint16_t) x[3] << 48));
+  vcorr = _mm256_set1_epi32(128 * (x[0] + x[1] + x[2] + x[3]));
+
+  for (; j + 8 <= n; j += 8)
+  {
+    lo = _mm256_madd_epi16(va, _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) (b + j))));
+    hi = _mm256_madd_epi16(va, _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) (b + j + 4))));
+    lo = _mm256_permute4x64_epi64(_mm256_hadd_epi32(lo, hi), 0xd8);
+
+    vc = _mm256_loadu_si256((const __m256i *) (c + j));
+    vc = _mm256_add_epi32(vc, _mm256_sub_epi32(lo, vcorr));
+    _mm256_storeu_si256((__m256i *) (c + j), vc);
+  }
+
+  dot_i8_scalar(c + j, a, b + j, n - j);
+}
+
+/*
+ *
+ * 512-bit pmaddwd, sixteen groups at a time.
+ *
+ */
+__attribute__((target("avx512bw")))
+void dot_i16_avx512(int *c, int a, const int *b, int n)
+{
+  const __m512i va = _mm512_set1_epi32(a);
+  __m512i vc;
+  int j = 0;
+
+  for (; j + 16 <= n; j += 16)
+  {
+    vc = _mm512_loadu_si512(c + j);
+    vc = _mm512_add_epi32(vc, _mm512_madd_epi16(va, _mm512_loadu_si512(b + j)));
+    _mm512_storeu_si512(c + j, vc);
+  }
+
+  dot_i16_scalar(c + j, a, b + j, n - j);
+}
+
+#endif
+
+#ifdef HAVE_VNNI_KERNELS
+
+/*
+ *
+ * VNNI fuses the multiply and both adds: vpdpwssd for int16 pairs, and vpdpbusd for
+ * int8 quads, which takes one operand unsigned.  That operand is b with its 128
+ * offset, so a's sum times 128 is taken back off.
+ *
+ */
+__attribute__((target("avx512bw,avx512vnni")))
+void dot_i16_vnni(int *c, int a, const int *b, int n)
+{
+  const __m512i va = _mm512_set1_epi32(a);
+  int j = 0;
+
+  for (; j + 16 <= n; j += 16)
+    _mm512_storeu_si512(c + j, _mm512_dpwssd_epi32(_mm512_loadu_si512(c + j), va,
+                                                   _mm512_loadu_si512(b + j)));
+
+  dot_i16_scalar(c + j, a, b + j, n - j);
+}
+
+__attribute__((target("avx512bw,avx512vnni")))
+void dot_i8_vnni(int *c, int a, const int *b, int n)
+{
+  int8_t x[4];
+  __m512i va, vcorr, vc;
+  int j = 0;
+
+  memcpy(x, &a, sizeof(x));
+  va = _mm512_set1_epi32(a);
+  vcorr = _mm512_set1_epi32(128 * (x[0] + x[1] + x[2] + x[3]));
+
+  for (; j + 16 <= n; j += 16)
+  {
+    vc = _mm512_sub_epi32(_mm512_loadu_si512(c + j), vcorr);
+    _mm512_storeu_si512(c + j, _mm512_dpbusd_epi32(vc, _mm512_loadu_si512(b + j), va));
+  }
+
+  dot_i8_scalar(c + j, a, b + j, n - j);
+}
+
+#endif
+
+// every quantized kernel set built into this binary, fastest first.  Plain AVX-512
+// has no better int8 product than the AVX2 one.
+const QuantKernels quant_table[] =
+{
+#ifdef HAVE_VNNI_KERNELS
+  { "avx512vnni", CPU_AVX512BW | CPU_AVX512VNNI, dot_i16_vnni, dot_i8_vnni },
+#endif
+#ifdef HAVE_QUANT_KERNELS
+  { "avx512bw", CPU_AVX2 | CPU_AVX512BW, dot_i16_avx512, dot_i8_avx2 },
+  { "avx2", CPU_AVX2, dot_i16_avx2, dot_i8_avx2 },
+#endif
+  { "scalar", 0, dot_i16_scalar, dot_i8_scalar }
+};
+
+/*
+ *
+ * Query cpuid (and xgetbv, for the register state the OS saves) and return the
+ * CPU_* mask of instruction sets this host can run.
+ *
+ */
+unsigned int cpu_features(void)
+{
+  unsigned int features = 0;
+#ifdef HAVE_X86_KERNELS
+  unsigned int eax, ebx, ecx, edx;
+  unsigned int xcr0 = 0;
+
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+    return 0;
+
+  if (ecx & CPUID_SSE41)
+    features |= CPU_SSE41;
+
+  // AVX state (ymm, and zmm/opmask for AVX-512) is usable only if the OS saves it.
+  if ((ecx & CPUID_OSXSAVE) && (ecx & CPUID_AVX))
+    __asm__ ("xgetbv" : "=a" (xcr0), "=d" (edx) : "c" (0));
+
+  if (__get_cpuid_max(0, NULL) >= 7)
+  {
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+    if ((ebx & CPUID_AVX2) && (xcr0 & 0x6) == 0x6)
+      features |= CPU_AVX2;
+    if ((ebx & CPUID_AVX512F) && (xcr0 & 0xe6) == 0xe6)
+      features |= CPU_AVX512F;
+    if ((ebx & CPUID_AVX512BW) && (xcr0 & 0xe6) == 0xe6)
+      features |= CPU_AVX512BW;
+    if ((ecx & CPUID_AVX512VNNI) && (xcr0 & 0xe6) == 0xe6)
+      features |= CPU_AVX512VNNI;
+  }
+#endif
+
+  return features;
+}
+
+/*
+ *
+ * Set kern to the named kernel set, or to the fastest one this CPU supports when name
+ * is NULL.  Returns -1, leaving kern alone, if the name is unknown or the CPU cannot
+ * run that set.
+ *
+ */
+int select_kernels(const char *name)
+{
+  const unsigned int features = cpu_features();
+  const int count = sizeof(kernel_table) / sizeof(kernel_table[0]);
+  int i;
+
+  for (i=0; i<count; i++)
+  {
+    if (name != NULL && strcmp(name, kernel_table[i].name) != 0)
+      continue;
+
+    if ((kernel_table[i].features & features) == kernel_table[i].features)
+    {
+      kern = kernel_table[i];
+      return 0;
+    }
+
+    if (name != NULL)
+      return -1;
+  }
+
+  return -1;
+}
+
+/*
+ *
+ * Size in bytes of an element of the narrow type.
+ *
+ */
+int quant_size(int type)
+{
+  return type == MAT_INT8 ? 1 : 2;
+}
+
+/*
+ *
+ * Narrow the rows x cols int32 matrix a (leading dimension lda) to type, each row
+ * padded with zeros to a whole number of k-groups, so row i's group x is element
+ * i * groups + x of the returned ints.  Returns NULL if an element does not fit the
+ * narrow type.
+ *
+ */
+int *quant_a(int type, int rows, int cols, const int *a, int lda, int groups)
+{
+  const int lo = type == MAT_INT8 ? INT8_MIN : INT16_MIN;
+  const int hi = type == MAT_INT8 ? INT8_MAX : INT16_MAX;
+  char *q, *dst;
+  int16_t s;
+  int i, x, v;
+
+  q = calloc((size_t) rows * groups, sizeof(int));
+  if (q == NULL)
+  {
+    perror("[ERROR]");
+    exit(EXIT_FAILURE);
+  }
+
+  for (i=0; i<rows; i++)
+  {
+    dst = q + (size_t) i * groups * sizeof(int);
+
+    for (x=0; x<cols; x++)
+    {
+      v = a[(size_t) i * lda + x];
+      if (v < lo || v > hi)
+      {
+        free(q);
+        return NULL;
+      }
+
+      if (type == MAT_INT8)
+        dst[x] = (int8_t) v;
+      else
+      {
+        s = (int16_t) v;
+        memcpy(dst + 2 * x, &s, sizeof(s));
+      }
+    }
+  }
+
+  return (int *) q;
+}
+
+/*
+ *
+ * Narrow the k x n int32 matrix b (leading dimension ldb) to type and pack it for
+ * gemm_packed.  Each int of a packed row holds one k-group of a column, the column's
+ * next two (int16) or four (int8) elements down, so a row of groups lines up with the
+ * output lanes of pmaddwd and vpdpbusd.  int8 elements are stored offset by 128 as
+ * unsigned bytes, the form vpdpbusd needs.  The grouped rows are then packed like an
+ * int32 B.  Returns -1 if an element does not fit the narrow type.
+ *
+ */
+int quant_b(Pool *pool, PackedB *pb, int type, int k, int n, const int *b, int ldb,
+            int groups)
+{
+  const int esize = quant_size(type);
+  const int group = 4 / esize;
+  const int lo = type == MAT_INT8 ? INT8_MIN : INT16_MIN;
+  const int hi = type == MAT_INT8 ? INT8_MAX : INT16_MAX;
+  char *q, *dst;
+  int16_t s;
+  int x, j, v;
+
+  q = calloc((size_t) groups * n, sizeof(int));
+  if (q == NULL)
+  {
+    perror("[ERROR]");
+    exit(EXIT_FAILURE);
+  }
+
+  // the padding past the last row must read as zero, which for int8 is 128.
+  if (type == MAT_INT8)
+    memset(q, 128, (size_t) groups * n * sizeof(int));
+
+  for (x=0; x<k; x++)
+  {
+    for (j=0; j<n; j++)
+    {
+      v = b[(size_t) x * ldb + j];
+      if (v < lo || v > hi)
+      {
+        free(q);
+        return -1;
+      }
+
+      dst = q + ((size_t) (x / group) * n + j) * sizeof(int) + (x % group) * esize;
+      if (type == MAT_INT8)
+        *dst = (char) (v + 128);
+      else
+      {
+        s = (int16_t) v;
+        memcpy(dst, &s, sizeof(s));
+      }
+    }
+  }
+
+  pack_b(pool, pb, MAT_INT32, groups, n, q, n);
+  pb->type = type;
+
+  free(q);
+
+  return 0;
+}
+
+/*
+ *
+ * Set qkern to the named quantized kernel set, or to the fastest one this CPU supports
+ * when name is NULL, as select_kernels does for kern.
+ *
+ */
+int select_quant(const char *name)
+{
+  const unsigned int features = cpu_features();
+  const int count = sizeof(quant_table) / sizeof(quant_table[0]);
+  int i;
+
+  for (i=0; i<count; i++)
+  {
+    if (name != NULL && strcmp(name, quant_table[i].name) != 0)
+      continue;
+
+    if ((quant_table[i].features & features) == quant_table[i].features)
+    {
+      qkern = quant_table[i];
+      return 0;
+    }
+
+    if (name != NULL)
+      return -1;
+  }
+
+  return -1;
+}
+
+
+/*
+ *
+ * Size in bytes of one element of the given type.
+ *
+ */
+size_t type_size(int type)
+{
+  return type == MAT_FLOAT32 ? sizeof(float) : sizeof(int);
+}
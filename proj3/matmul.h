@@ -0,0 +1,68 @@
+/*
+ *
+ * matmul.h
+ *
+ * Project 3, Part 1 - libmatmul, the multiply engine behind matrix.x
+ *
+ * A matmul_ctx owns a pool of worker threads which stay alive between calls, so a
+ * process creates one context and multiplies on it as often as it likes.  Every
+ * operand is a caller-owned row-major buffer with an explicit leading dimension (the
+ * distance in elements between the starts of two rows), and is neither copied nor
+ * kept after the call returns, except by matmul_pack.
+ *
+ *   matmul_ctx *ctx = matmul_create(4, 0);
+ *   matmul_multiply(ctx, MATMUL_FLOAT32, m, n, k, a, k, b, n, c, n);
+ *   matmul_free(ctx);
+ *
+ * Calls on one context must not overlap; use a context per calling thread.  The
+ * kernels are chosen for the whole process, since they depend only on the CPU.
+ * Functions returning int give 0 on success and -1 for invalid arguments.  Running
+ * out of memory is fatal.
+ *
+*/
+
+#ifndef MATMUL_H
+#define MATMUL_H
+
+// element types.  Products of int32 wrap on overflow.
+#define MATMUL_INT32 1
+#define MATMUL_FLOAT32 2
+
+// matmul_create flags: pin each worker to its own CPU, spread over the NUMA nodes.
+// Each node then computes its own share of the rows of C first (see matmul_touch).
+#define MATMUL_PIN 0x1
+
+typedef struct matmul_ctx matmul_ctx;
+typedef struct matmul_packed matmul_packed;
+
+// one product of a batch: c = a*b.
+typedef struct matmul_triple
+{
+  const void *a;
+  const void *b;
+  void *c;
+} matmul_triple;
+
+matmul_ctx *matmul_create(int nthreads, int flags);
+void matmul_free(matmul_ctx *ctx);
+int matmul_threads(const matmul_ctx *ctx);
+
+int matmul_set_kernels(const char *name);
+const char *matmul_kernels(void);
+
+int matmul_multiply(matmul_ctx *ctx, int type, int m, int n, int k, const void *a, int lda,
+                    const void *b, int ldb, void *c, int ldc);
+int matmul_multiply_steal(matmul_ctx *ctx, int type, int m, int n, int k, const void *a,
+                          int lda, const void *b, int ldb, void *c, int ldc, int strassen);
+
+matmul_packed *matmul_pack(matmul_ctx *ctx, int type, int k, int n, const void *b, int ldb);
+int matmul_multiply_packed(matmul_ctx *ctx, int m, const void *a, int lda,
+                           const matmul_packed *b, void *c, int ldc);
+void matmul_free_packed(matmul_packed *b);
+
+int matmul_multiply_batch(matmul_ctx *ctx, int type, int m, int n, int k,
+                          const matmul_triple *batch, int count, int lda, int ldb, int ldc);
+
+int matmul_touch(matmul_ctx *ctx, int type, int rows, int cols, void *c, int ldc);
+
+#endif
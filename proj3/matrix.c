@@ -3,19 +3,142 @@
  * matrix.c
  * Tim Green
  * 3/20/14
- * version 1.0
+ * version 1.16
  *
  * Project 3, Part 1 - Matrix Multiplication
  *
+ * matrix.x [-t <threads>] [-a] [-k <kernel>] [-r <repeats>] [-u | -w [-S <size>]] [-p]
+ *          [-v] <A.mat> <B.mat> <C.mat>
+ * matrix.x [-t <threads>] [-k <kernel>] [-v] -m <MB> <A.mat> <B.mat> <C.mat>
+ * matrix.x [-t <threads>] [-k <kernel>] [-v] -c <A1.mat> <A2.mat> [<A3.mat> ...] <C.mat>
+ * matrix.x [-f] [-d <density> [-z coo]] -g <rows>x<cols> <out.mat>
+ * matrix.x [-t <threads>] [-a | -N] [-k <kernel>] [-r <repeats>] [-u | -w [-S <size>]]
+ *          [-f] [-v] -n <size>
+ * matrix.x [-t <threads>] [-r <repeats>] [-f] [-v] -b <count> [-x <m>x<k>x<n>]
+ * matrix.x [-t <threads>] [-k <kernel>] [-r <repeats>] [-v] -q 8|16 -n <size>
+ * matrix.x [-t <threads>] -M
+ * matrix.x [-t <threads>] [-a] [-k <kernel>] [-r <repeats>] [-S <size>] [-f] [-v]
+ *          -B <shape>[,<shape>...]
+ * matrix.x [-t <threads>] [-p]
+ *
+ * Operand files use the binary layout described at MatHeader and are mapped
+ * read-only; C is written straight into a mapped output file, so no operand is
+ * ever parsed or copied.  -g writes a random matrix in that format, or with -d a
+ * sparse one with about that fraction of nonzeros (CSR, or COO with -z coo).  -n multiplies
+ * random in-memory square matrices and reports the elapsed time.  With no files,
+ * the built-in 3x2 * 2x3 example is computed both by the original thread-per-element
+ * reference (CalcProduct) and by the tiled worker pool, and the two are compared.
+ *
+ * The multiply engine is libmatmul (matmul.c, public API in matmul.h); this file is
+ * its command line driver.  The sparse, streaming and chain drivers below work on the
+ * engine directly through matmul-internal.h.
+ *
+ * Elements are int32, or float32 with -f (files carry their own type).  The inner
+ * kernels are picked at startup from the fastest instruction set the CPU supports;
+ * -k scalar|sse4.1|avx2|avx512 forces one of them.
+ *
+ * B is packed into column panels (see PackedB) before multiplying, so both operands
+ * are streamed sequentially.  -r repeats the multiply that many times against the
+ * same packed B, as when B is a fixed weight matrix; -u multiplies unpacked instead.
+ *
+ * -w uses the recursive divide-and-conquer multiply on work-stealing deques (see
+ * gemm_steal) instead of a static split of C, which keeps every worker busy on
+ * tall-skinny and other odd shapes.  -S switches it to Strassen's algorithm for
+ * blocks with every dimension even and at least <size>.
+ *
+ * A sparse A is multiplied by a dense or sparse B row by row on the same pool (see
+ * run_sparse).  COO inputs are converted to CSR when they are opened, and a sparse
+ * product is written as CSR or dense depending on its estimated fill.
+ *
+ * -m multiplies dense files out of core, in panels sized to a memory budget of <MB>
+ * megabytes (see run_stream), for operands larger than RAM.
+ *
+ * -c multiplies a chain of dense files A1 A2 ... An in the order with the fewest
+ * multiply-adds, computing independent subproducts together on the pool and
+ * recycling intermediate buffers (see run_chain).
+ *
+ * -a pins each worker to its own CPU, spreading the workers evenly over the NUMA
+ * nodes.  -N (which implies -a) also splits the rows of C among the nodes in
+ * proportion to their workers, places each node's rows of A and C in its own memory
+ * by first touch, and has a node steal tiles from other nodes only once its own are
+ * done.  -M prints a node-to-node read bandwidth matrix, to show the remote penalty.
+ *
+ * -q multiplies the -n matrices a second time with both operands narrowed to int8 or
+ * int16, accumulating in int32 with pmaddwd or VNNI where the CPU has them (see
+ * quant_b), and reports the time and operand bytes against the int32 multiply.
+ * There -k scalar|avx2|avx512bw|avx512vnni picks the quantized kernels.
+ *
+ * -B benchmarks the dense multiply and prints CSV (see run_bench); each shape is
+ * <size> for a square product or <m>x<k>x<n>.  make bench runs a standard sweep into
+ * bench.csv.
+ *
+ * -b multiplies a batch of <count> random small products of one shape (default the
+ * 3x2 * 2x3 example) with gemm_batch and reports products per second.  The whole
+ * batch is spread over the persistent pool, so no product pays for a thread.
+ *
+ * -p prints A, B and C when they are no larger than PRINT_MAX in either dimension.
+ * -v checks every element of C against CalcProduct (otherwise -n spot checks
+ * SPOT_CHECKS elements).
+ *
 */
 
-#define M 3 
-#define K 2 
+// for sched_setaffinity and the CPU_* macros.
+#define _GNU_SOURCE
+
+#define M 3
+#define K 2
 #define N 3
 
+// sparse products hand out SPARSE_CHUNK rows of A at a time, and write C dense once
+// its estimated fraction of nonzeros reaches SPARSE_DENSE_FILL.
+#define SPARSE_CHUNK 16
+#define SPARSE_DENSE_FILL 0.25
+
+// phases of a sparse product job.
+#define SPARSE_SPMM 1
+#define SPARSE_DENSE 2
+#define SPARSE_SYMBOLIC 3
+#define SPARSE_NUMERIC 4
+
+// size of the buffer each -M bandwidth measurement reads.
+#define BW_BYTES (256 << 20)
+
+// -B runs each multiply variant of run_bench: packed B, unpacked B, work stealing.
+#define BENCH_VARIANTS 3
+
+// number of C elements checked against CalcProduct when -v is not given.
+#define SPOT_CHECKS 64
+
+// largest row or column count that -p will print.
+#define PRINT_MAX 16
+
+// float32 results may differ from CalcProduct by this much (relative to the larger
+// of 1 and the reference value), since the kernels sum in a different order.
+#define FLOAT_TOL 1e-3f
+
+// matrix file format: a MAT_HEADER_SIZE byte header followed by the elements in
+// row-major order, or by the sparse arrays described at mat_layout.  The header size
+// keeps the data cache-line aligned in the mapping.  The type field holds
+// MAT_INT32 or MAT_FLOAT32 (see matmul-internal.h).
+#define MAT_MAGIC "MTX1"
+#define MAT_HEADER_SIZE 64
+
+#define MAT_DENSE 0
+#define MAT_CSR 1
+#define MAT_COO 2
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
 #include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "matmul-internal.h"
 
 void *CalcProduct(void *param);
 
@@ -23,42 +146,377 @@ typedef struct v
 {
   int i;
   int j;
+  int value;
+  float fvalue;
 } Element;
 
-// A[COLS] == B[ROWS]
-int A[M][K] = { {1,4}, {2,5}, {3,6} };  // 3x2
-int B[K][N] = { {8,7,6}, {5,4,3} };     // 2x3
+// on-disk header of a matrix file.  Elements are stored in host byte order.  nnz is
+// only meaningful for the sparse formats.
+typedef struct mat_header
+{
+  char magic[4];
+  uint32_t type;
+  uint64_t rows;
+  uint64_t cols;
+  uint64_t nnz;
+  uint32_t format;
+  char pad[MAT_HEADER_SIZE - 36];
+} MatHeader;
+
+// a row-major dense or CSR matrix, either backed by a mapped file (map != NULL) or by
+// the heap.  For CSR, data holds the nnz values and owned marks heap arrays built
+// from a COO file.
+typedef struct matrix
+{
+  int type;
+  int format;
+  int rows;
+  int cols;
+  size_t nnz;
+  int64_t *row_ptr;
+  int *col_idx;
+  void *data;
+  int owned;
+  void *map;
+  size_t map_len;
+  int fd;
+} Matrix;
 
-int C[M][N];
+#define MAT_I32(mat) ((int *) (mat)->data)
+#define MAT_F32(mat) ((float *) (mat)->data)
 
-int main(void)
+// one node of a matrix chain's evaluation tree: operand i of the chain for the first
+// count nodes (left < 0), otherwise the product of two earlier nodes, computed by g
+// in the given round.  bytes is the size of an intermediate product's buffer.
+typedef struct chain_node
 {
+  int left, right;
+  int rows, cols;
+  void *data;
+  size_t bytes;
+  int round;
+  Gemm g;
+} ChainNode;
 
-  Element E[M][N]; 
-  pthread_t tid[M][N];
-  pthread_attr_t attr;
+// a matrix chain and its free list of intermediate buffers.  peak is the memory the
+// buffers actually take, total what the intermediates would take without reuse.
+typedef struct chain
+{
+  int count;
+  int type;
+  ChainNode *node;
+  int nodes;
+  void **free_buf;
+  size_t *free_bytes;
+  int nfree;
+  int buffers;
+  size_t peak;
+  size_t total;
+} Chain;
 
-  int i, j;
+// the products of one round of chain_run.  Their tiles are numbered one after the
+// other, product i's starting at first[i].
+typedef struct chain_job
+{
+  Gemm **gemm;
+  int *first;
+  int count;
+  int ntiles;
+  int next;
+} ChainJob;
 
-  printf("Matrix A:\n");
-  for (i=0; i<M; i++)
+// shared state of one numa_bandwidth measurement.
+typedef struct bandwidth
+{
+  Pool *pool;
+  void *buf;
+  int node;
+  int touch;
+  size_t next;
+} Bandwidth;
+
+// shared state of one sparse product.  marker, cols and accum are per-worker scratch
+// rows of B->cols entries; counts collects the row lengths of a sparse C.
+typedef struct sparse_job
+{
+  int nthreads;
+  int phase;
+  int next;
+  int64_t *counts;
+  int *marker;
+  int *cols;
+  void *accum;
+} SparseJob;
+
+void numa_bandwidth(Pool *pool);
+void bandwidth_worker(void *arg, int id);
+
+int run_batch(Pool *pool);
+int run_sparse(Pool *pool, const char *path);
+int run_stream(Pool *pool, const char *path);
+int run_chain(Pool *pool, char **paths, int count);
+long long chain_order(const int *dims, int count, int *split);
+int chain_build(Chain *ch, const int *split, int i, int j);
+void chain_print(const Chain *ch, int node);
+void chain_run(Pool *pool, Chain *ch, int root);
+void chain_worker(void *arg, int id);
+void *chain_alloc(Chain *ch, size_t *bytes);
+void chain_release(Chain *ch, void *buf, size_t bytes);
+int chain_check(const Chain *ch, const Matrix *ops, int rows);
+void map_advise(const Matrix *mat, const void *addr, size_t len, int advice);
+void sparse_run(Pool *pool, SparseJob *job, int phase);
+void sparse_worker(void *arg, int id);
+long mat_find(const Matrix *mat, int row, int col);
+int coo_to_csr(Matrix *mat, const int *row_idx, const int *col_idx, const void *values);
+int indices_valid(const int *idx, size_t count, int limit);
+int csr_valid(const Matrix *mat);
+size_t mat_layout(int format, int type, int rows, int cols, size_t nnz, size_t *idx_off,
+                  size_t *val_off);
+
+void mat_alloc(Matrix *mat, int type, int rows, int cols);
+void mat_open(Matrix *mat, const char *path);
+void mat_create(Matrix *mat, const char *path, int type, int rows, int cols);
+void mat_create_sparse(Matrix *mat, const char *path, int format, int type, int rows,
+                       int cols, size_t nnz);
+void mat_close(Matrix *mat);
+void mat_fill_random(Matrix *mat);
+void mat_print(const char *name, const Matrix *mat);
+void mat_generate(const char *dims, const char *path, int type);
+void mat_generate_sparse(const char *dims, const char *path, int type);
+
+int run_demo(Pool *pool);
+int run_files(Pool *pool, char **paths);
+int run_random(Pool *pool);
+int run_multiply(Pool *pool, int verify);
+double multiply(Pool *pool, double *pack);
+int run_bench(const char *shapes);
+int run_quant(Pool *pool);
+int check_product(int samples);
+int check_element(Element *e);
+double now(void);
+
+// operands and product of the current run.  CalcProduct reads A and B directly.
+Matrix A, B, C;
+
+// command line settings.
+typedef struct options
+{
+  int nthreads;
+  int size;
+  int type;
+  int repeats;
+  int unpacked;
+  int steal;
+  int strassen;
+  double density;
+  int sparse_format;
+  int batch;
+  char *shape;
+  size_t budget;
+  int chain;
+  int quant;
+  int pin;
+  int numa;
+  int bandwidth;
+  int print;
+  int verify;
+  char *shapes;
+  char *dims;
+  char *kernel;
+} Options;
+
+Options cfg;
+
+// A[COLS] == B[ROWS]
+const int demo_a[M][K] = { {1,4}, {2,5}, {3,6} };  // 3x2
+const int demo_b[K][N] = { {8,7,6}, {5,4,3} };     // 2x3
+
+int main(int argc, char **argv)
+{
+  int opt;
+  int rc, usage = 0;
+  Pool *pool;
+
+  cfg.nthreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+  cfg.type = MAT_INT32;
+  cfg.repeats = 1;
+
+  while ((opt = getopt(argc, argv, "t:n:g:k:r:S:d:z:b:x:m:B:q:fuwcaNMpv")) != -1)
   {
-    for (j=0; j<K; j++)
-      printf("%d ", A[i][j]);
+    switch (opt)
+    {
+      case 't':
+        cfg.nthreads = atoi(optarg);
+        break;
+      case 'n':
+        cfg.size = atoi(optarg);
+        break;
+      case 'g':
+        cfg.dims = optarg;
+        break;
+      case 'k':
+        cfg.kernel = optarg;
+        break;
+      case 'r':
+        cfg.repeats = atoi(optarg);
+        break;
+      case 'f':
+        cfg.type = MAT_FLOAT32;
+        break;
+      case 'S':
+        cfg.strassen = atoi(optarg);
+        break;
+      case 'd':
+        cfg.density = atof(optarg);
+        break;
+      case 'b':
+        cfg.batch = atoi(optarg);
+        break;
+      case 'x':
+        cfg.shape = optarg;
+        break;
+      case 'B':
+        cfg.shapes = optarg;
+        break;
+      case 'm':
+        cfg.budget = (size_t) atoi(optarg) << 20;
+        break;
+      case 'z':
+        cfg.sparse_format = strcmp(optarg, "coo") == 0 ? MAT_COO : MAT_CSR;
+        break;
+      case 'u':
+        cfg.unpacked = 1;
+        break;
+      case 'a':
+        cfg.pin = 1;
+        break;
+      case 'N':
+        cfg.pin = cfg.numa = 1;
+        break;
+      case 'M':
+        cfg.pin = cfg.bandwidth = 1;
+        break;
+      case 'w':
+        cfg.steal = 1;
+        break;
+      case 'c':
+        cfg.chain = 1;
+        break;
+      case 'q':
+        cfg.quant = atoi(optarg);
+        break;
+      case 'p':
+        cfg.print = 1;
+        break;
+      case 'v':
+        cfg.verify = 1;
+        break;
+      default:
+        usage = 1;
+        break;
+    }
+  }
 
-    printf("\n");
+  // exactly zero or three files for a multiply, one file for -g, at least three for -c;
+  // -q works on int32 -n matrices.
+  if (usage || (cfg.dims != NULL && argc - optind != 1) ||
+      (cfg.chain && argc - optind < 3) ||
+      (cfg.quant && ((cfg.quant != 8 && cfg.quant != 16) || cfg.size < 1 ||
+                     cfg.type != MAT_INT32)) ||
+      (cfg.dims == NULL && !cfg.chain && argc - optind != 0 && argc - optind != 3))
+  {
+    printf("\nHelp:\n");
+    printf("matrix.x [-t <threads>] [-a] [-k <kernel>] [-r <repeats>] [-u | -w [-S <size>]] "
+           "[-p] [-v] <A.mat> <B.mat> <C.mat>\n");
+    printf("matrix.x [-t <threads>] [-k <kernel>] [-v] -m <MB> <A.mat> <B.mat> <C.mat>\n");
+    printf("matrix.x [-t <threads>] [-k <kernel>] [-v] -c <A1.mat> <A2.mat> [<A3.mat> ...] "
+           "<C.mat>\n");
+    printf("matrix.x [-f] [-d <density> [-z coo]] -g <rows>x<cols> <out.mat>\n");
+    printf("matrix.x [-t <threads>] [-a | -N] [-k <kernel>] [-r <repeats>] [-u | -w [-S <size>]] "
+           "[-f] [-v] -n <size>\n");
+    printf("matrix.x [-t <threads>] [-r <repeats>] [-f] [-v] -b <count> [-x <m>x<k>x<n>]\n");
+    printf("matrix.x [-t <threads>] [-k <kernel>] [-r <repeats>] [-v] -q 8|16 -n <size>\n");
+    printf("matrix.x [-t <threads>] -M\n");
+    printf("matrix.x [-t <threads>] [-a] [-k <kernel>] [-r <repeats>] [-S <size>] [-f] [-v] "
+           "-B <shape>[,<shape>...]\n");
+    printf("matrix.x [-t <threads>] [-p]\n\n");
+    exit(0);
   }
-  printf("\n");
 
-  printf("Matrix B:\n");
-  for (i=0; i<K; i++)
+  if (cfg.dims != NULL)
   {
-    for (j=0; j<M; j++)
-      printf("%d ", B[i][j]);
+    if (cfg.density > 0)
+      mat_generate_sparse(cfg.dims, argv[optind], cfg.type);
+    else
+      mat_generate(cfg.dims, argv[optind], cfg.type);
+    return 0;
+  }
 
-    printf("\n");
+  if (cfg.nthreads < 1)
+    cfg.nthreads = 1;
+  if (cfg.repeats < 1)
+    cfg.repeats = 1;
+
+  // the divide-and-conquer multiply reads B in place.
+  if (cfg.steal)
+    cfg.unpacked = 1;
+
+  // the benchmark makes its own pools and picks its own kernels.
+  if (cfg.shapes != NULL)
+    return run_bench(cfg.shapes);
+
+  // with -q, -k names the quantized kernels and int32 runs on the fastest ones.
+  if (matmul_set_kernels(cfg.quant ? NULL : cfg.kernel))
+  {
+    printf("[ERROR]: cannot use the %s kernels\n", cfg.kernel);
+    exit(EXIT_FAILURE);
   }
-  printf("\n");
+
+  pool = matmul_create(cfg.nthreads, cfg.pin ? MATMUL_PIN : 0);
+
+  if (cfg.bandwidth)
+  {
+    numa_bandwidth(pool);
+    rc = 0;
+  }
+  else if (cfg.batch > 0)
+    rc = run_batch(pool);
+  else if (cfg.quant)
+    rc = run_quant(pool);
+  else if (cfg.size > 0)
+    rc = run_random(pool);
+  else if (cfg.chain)
+    rc = run_chain(pool, &argv[optind], argc - optind - 1);
+  else if (argc - optind == 3)
+    rc = run_files(pool, &argv[optind]);
+  else
+    rc = run_demo(pool);
+
+  matmul_free(pool);
+
+  return rc;
+}
+
+/*
+ *
+ * Multiply the built-in example with both the per-element reference threads and the
+ * worker pool, and report whether they agree.
+ *
+ */
+int run_demo(Pool *pool)
+{
+  Element E[M][N];
+  pthread_t tid[M][N];
+  pthread_attr_t attr;
+
+  int i, j, rc;
+  int mismatch = 0;
+
+  mat_alloc(&A, MAT_INT32, M, K);
+  mat_alloc(&B, MAT_INT32, K, N);
+  mat_alloc(&C, MAT_INT32, M, N);
+  memcpy(A.data, demo_a, sizeof(demo_a));
+  memcpy(B.data, demo_b, sizeof(demo_b));
 
   // Explicitly create joinable threads, even though it should be the default.
   pthread_attr_init(&attr);
@@ -66,12 +524,12 @@ int main(void)
 
   for (i=0; i<M; i++)
   {
-    for (j=0; j<N; j++) 
+    for (j=0; j<N; j++)
     {
       E[i][j].i = i;
       E[i][j].j = j;
-      int rc = pthread_create(&tid[i][j], &attr, CalcProduct, (void *) &E[i][j]);
-      if (rc) 
+      rc = pthread_create(&tid[i][j], &attr, CalcProduct, (void *) &E[i][j]);
+      if (rc)
       {
         perror("[ERROR]");
         exit(EXIT_FAILURE);
@@ -81,11 +539,11 @@ int main(void)
 
   pthread_attr_destroy(&attr);
 
-  for (i=0; i<M; i++) 
+  for (i=0; i<M; i++)
   {
-    for (j=0; j<N; j++) 
+    for (j=0; j<N; j++)
     {
-      int rc = pthread_join(tid[i][j], NULL);
+      rc = pthread_join(tid[i][j], NULL);
       if (rc)
       {
         printf("[ERROR]: return code from pthread_join is %d", rc);
@@ -94,38 +552,1970 @@ int main(void)
     }
   }
 
-  printf("Matrix C = AB\n");
+  rc = run_multiply(pool, 0);
+
   for (i=0; i<M; i++)
-  {
     for (j=0; j<N; j++)
-      printf("%d ", C[i][j]);
+      if (MAT_I32(&C)[i * N + j] != E[i][j].value)
+        mismatch++;
 
-    printf("\n");
+  if (mismatch)
+  {
+    printf("[ERROR]: worker pool result differs from reference in %d elements\n", mismatch);
+    rc = EXIT_FAILURE;
+  }
+  else
+    printf("Worker pool (%d threads) matches reference.\n", pool->nthreads);
+
+  mat_close(&A);
+  mat_close(&B);
+  mat_close(&C);
+
+  return rc;
+}
+
+/*
+ *
+ * Multiply the matrix files paths[0] and paths[1], writing the product to paths[2].
+ *
+ */
+int run_files(Pool *pool, char **paths)
+{
+  int rc;
+
+  mat_open(&A, paths[0]);
+  mat_open(&B, paths[1]);
+
+  if (A.cols != B.rows || A.type != B.type)
+  {
+    printf("[ERROR]: cannot multiply %dx%d by %dx%d\n", A.rows, A.cols, B.rows, B.cols);
+    exit(EXIT_FAILURE);
+  }
+
+  if (A.format != MAT_DENSE)
+    rc = run_sparse(pool, paths[2]);
+  else if (B.format != MAT_DENSE)
+  {
+    printf("[ERROR]: a dense A times a sparse B is not supported\n");
+    exit(EXIT_FAILURE);
+  }
+  else if (cfg.budget > 0)
+    rc = run_stream(pool, paths[2]);
+  else
+  {
+    mat_create(&C, paths[2], A.type, A.rows, B.cols);
+    rc = run_multiply(pool, cfg.verify);
+  }
+
+  mat_close(&A);
+  mat_close(&B);
+  mat_close(&C);
+
+  return rc;
+}
+
+/*
+ *
+ * Multiply two random size x size matrices held in memory.
+ *
+ */
+int run_random(Pool *pool)
+{
+  const int size = cfg.size;
+  int rc;
+
+  mat_alloc(&A, cfg.type, size, size);
+  mat_alloc(&B, cfg.type, size, size);
+  mat_alloc(&C, cfg.type, size, size);
+  if (cfg.numa)
+  {
+    matmul_touch(pool, A.type, A.rows, A.cols, A.data, A.cols);
+    matmul_touch(pool, C.type, C.rows, C.cols, C.data, C.cols);
+  }
+  mat_fill_random(&A);
+  mat_fill_random(&B);
+
+  rc = run_multiply(pool, cfg.verify ? 1 : SPOT_CHECKS);
+
+  mat_close(&A);
+  mat_close(&B);
+  mat_close(&C);
+
+  return rc;
+}
+
+/*
+ *
+ * Compute C = AB on the worker pool cfg.repeats times, report the time per multiply,
+ * and optionally print the matrices and check the product.  B is packed once up front
+ * unless cfg.unpacked is set, and cfg.steal selects the divide-and-conquer multiply.  verify is 0 for no check, 1 for a full check, or the
+ * number of random elements to spot check.
+ *
+ */
+int run_multiply(Pool *pool, int verify)
+{
+  double elapsed, pack;
+  int bad;
+
+  mat_print("Matrix A", cfg.print ? &A : NULL);
+  mat_print("Matrix B", cfg.print ? &B : NULL);
+
+  elapsed = multiply(pool, &pack);
+
+  mat_print("Matrix C = AB", cfg.print ? &C : NULL);
+
+  printf("%dx%d * %dx%d on %d threads%s (%s, %s): %.3f s, %.2f GOP/s", A.rows, A.cols,
+         B.rows, B.cols, pool->nthreads,
+         cfg.numa ? ", NUMA placed" : cfg.pin ? ", pinned" : "", matmul_kernels(),
+         cfg.steal ? (cfg.strassen ? "work stealing, Strassen" : "work stealing") :
+         cfg.unpacked ? "unpacked B" : "packed B", elapsed, 2.0 * A.rows * B.cols * A.cols / elapsed / 1e9);
+  if (!cfg.unpacked)
+    printf(", pack %.3f s", pack);
+  printf("\n");
+
+  if (verify == 0)
+    return 0;
+
+  bad = check_product(verify == 1 ? 0 : verify);
+  if (bad)
+  {
+    printf("[ERROR]: %d elements of C differ from CalcProduct\n", bad);
+    return EXIT_FAILURE;
+  }
+
+  return 0;
+}
+
+/*
+ *
+ * Compute C = AB cfg.repeats times as run_multiply describes, and return the time of
+ * one multiply.  The time spent packing B is stored in pack unless it is NULL.
+ *
+ */
+double multiply(Pool *pool, double *pack)
+{
+  matmul_packed *pb = NULL;
+  double start, elapsed;
+  int r;
+
+  start = now();
+  if (!cfg.unpacked)
+    pb = matmul_pack(pool, B.type, B.rows, B.cols, B.data, B.cols);
+  if (pack != NULL)
+    *pack = cfg.unpacked ? 0 : now() - start;
+
+  start = now();
+  for (r=0; r<cfg.repeats; r++)
+  {
+    if (cfg.steal)
+      matmul_multiply_steal(pool, A.type, A.rows, B.cols, A.cols, A.data, A.cols, B.data,
+                            B.cols, C.data, C.cols, cfg.strassen);
+    else if (cfg.unpacked)
+      matmul_multiply(pool, A.type, A.rows, B.cols, A.cols, A.data, A.cols, B.data, B.cols,
+                      C.data, C.cols);
+    else
+      matmul_multiply_packed(pool, A.rows, A.data, A.cols, pb, C.data, C.cols);
+  }
+  elapsed = (now() - start) / cfg.repeats;
+
+  if (pb != NULL)
+    matmul_free_packed(pb);
+
+  return elapsed;
+}
+
+/*
+ *
+ * Compare C against CalcProduct, called directly rather than on its own thread.
+ * samples is the number of random elements to check, or 0 to check all of them.
+ * Returns the number of mismatched elements.
+ *
+ */
+int check_product(int samples)
+{
+  Element e;
+  int s, bad = 0;
+
+  if (samples == 0)
+  {
+    for (e.i=0; e.i<C.rows; e.i++)
+      for (e.j=0; e.j<C.cols; e.j++)
+        bad += check_element(&e);
+
+    return bad;
+  }
+
+  for (s=0; s<samples; s++)
+  {
+    e.i = rand() % C.rows;
+    e.j = rand() % C.cols;
+    bad += check_element(&e);
+  }
+
+  return bad;
+}
+
+/*
+ *
+ * Compute element (e->i, e->j) with CalcProduct and return 1 if C disagrees with it.
+ *
+ */
+int check_element(Element *e)
+{
+  const long idx = mat_find(&C, e->i, e->j);
+  float diff, scale;
+
+  CalcProduct(e);
+
+  if (C.type == MAT_INT32)
+    return (idx < 0 ? 0 : MAT_I32(&C)[idx]) != e->value;
+
+  diff = (idx < 0 ? 0 : MAT_F32(&C)[idx]) - e->fvalue;
+  scale = e->fvalue < 0 ? -e->fvalue : e->fvalue;
+  if (scale < 1.0f)
+    scale = 1.0f;
+
+  return diff > FLOAT_TOL * scale || -diff > FLOAT_TOL * scale;
+}
+
+/*
+ *
+ * Measure memory read bandwidth between every pair of nodes: a buffer of BW_BYTES is
+ * first touched by a worker on the memory node, then read by all the workers of the
+ * CPU node at once.  Prints one row per CPU node.
+ *
+ */
+void numa_bandwidth(Pool *pool)
+{
+  Bandwidth bw;
+  double start, elapsed;
+  int cpu_node, mem_node;
+
+  bw.pool = pool;
+  if (posix_memalign(&bw.buf, 64, BW_BYTES))
+  {
+    perror("[ERROR]");
+    exit(EXIT_FAILURE);
   }
+
+  printf("read bandwidth in GB/s, %d workers on %d nodes\n", pool->nthreads, pool->nnodes);
+  printf("cpu\\mem");
+  for (mem_node=0; mem_node<pool->nnodes; mem_node++)
+    printf("%8d", mem_node);
   printf("\n");
 
-  pthread_exit(NULL);
+  for (cpu_node=0; cpu_node<pool->nnodes; cpu_node++)
+  {
+    printf("%7d", cpu_node);
+
+    for (mem_node=0; mem_node<pool->nnodes; mem_node++)
+    {
+      // release the pages so the next touch places them afresh.
+      madvise(bw.buf, BW_BYTES, MADV_DONTNEED);
+      bw.node = mem_node;
+      bw.touch = 1;
+      pool_run(pool, bandwidth_worker, &bw);
+
+      bw.node = cpu_node;
+      bw.touch = 0;
+      bw.next = 0;
+      start = now();
+      pool_run(pool, bandwidth_worker, &bw);
+      elapsed = now() - start;
+
+      printf("%8.2f", BW_BYTES / elapsed / 1e9);
+    }
+
+    printf("\n");
+  }
+
+  free(bw.buf);
 }
 
 /*
  *
- *  This function builds a sum of i products.  Take element i of row j from Matrix A,
- *  and multiply it by element i of column k from Matrix B.  The result is stored in a
- *  global data structure so no value is returned.
+ * Pool job for numa_bandwidth.  When touching, the first worker of bw->node writes the
+ * whole buffer; when reading, every worker of bw->node sums chunks of it.
  *
-*/
-void *CalcProduct(void *param)
+ */
+void bandwidth_worker(void *arg, int id)
 {
-  Element *row_col = (Element *) param;
-  int i;
+  Bandwidth *bw = (Bandwidth *) arg;
+  Pool *pool = bw->pool;
+  const size_t chunk = BW_BYTES / 64;
+  volatile long sink;
+  long sum = 0;
+  size_t off, i;
+  int w;
 
-  const int ROW = row_col->i;
-  const int COL = row_col->j;
+  if (pool->node[id] != bw->node)
+    return;
+
+  if (bw->touch)
+  {
+    for (w=0; pool->node[w] != bw->node; w++)
+      ;
+    if (w == id)
+      memset(bw->buf, 1, BW_BYTES);
+    return;
+  }
+
+  while ((off = __sync_fetch_and_add(&bw->next, chunk)) < BW_BYTES)
+  {
+    const long *p = (const long *) ((char *) bw->buf + off);
+
+    for (i=0; i<chunk / sizeof(long); i++)
+      sum += p[i];
+  }
+
+  sink = sum;
+  (void) sink;
+}
+
+/*
+ *
+ * Benchmark the dense multiply over every shape in the comma-separated list shapes
+ * (each <size> or <m>x<k>x<n>), every kernel set this CPU supports (or just -k), the
+ * packed, unpacked and work-stealing variants, and 1, 2, 4, ... up to cfg.nthreads
+ * threads.  One CSV row is printed per run; efficiency is the speedup over the same
+ * run on one thread divided by the thread count.  Every run is checked against
+ * CalcProduct, in full with -v and otherwise at SPOT_CHECKS elements.
+ *
+ */
+int run_bench(const char *shapes)
+{
+  const char *kernels[] = { "avx512", "avx2", "sse4.1", "scalar" };
+  const int nkernels = sizeof(kernels) / sizeof(kernels[0]);
+  const char *variants[] = { "packed", "unpacked", "steal" };
+  char *list, *shape, *save;
+  double elapsed, pack, base[BENCH_VARIANTS];
+  int m, k, n, kernel, variant, threads, bad, failed = 0;
+  Pool *pool;
+
+  list = strdup(shapes);
+  if (list == NULL)
+  {
+    perror("[ERROR]");
+    exit(EXIT_FAILURE);
+  }
+
+  printf("m,k,n,type,kernel,variant,threads,seconds,pack_seconds,gflops,speedup,efficiency,errors\n");
+
+  for (shape=strtok_r(list, ",", &save); shape!=NULL; shape=strtok_r(NULL, ",", &save))
+  {
+    if (sscanf(shape, "%dx%dx%d", &m, &k, &n) != 3)
+    {
+      if (sscanf(shape, "%d", &m) != 1)
+        m = 0;
+      k = n = m;
+    }
+
+    if (m < 1 || k < 1 || n < 1)
+    {
+      printf("[ERROR]: expected <size> or <m>x<k>x<n>, got %s\n", shape);
+      exit(EXIT_FAILURE);
+    }
 
-  C[ROW][COL] = 0;
+    mat_alloc(&A, cfg.type, m, k);
+    mat_alloc(&B, cfg.type, k, n);
+    mat_alloc(&C, cfg.type, m, n);
+    mat_fill_random(&A);
+    mat_fill_random(&B);
+
+    for (kernel=0; kernel<nkernels; kernel++)
+    {
+      if ((cfg.kernel != NULL && strcmp(cfg.kernel, kernels[kernel]) != 0) ||
+          matmul_set_kernels(kernels[kernel]))
+        continue;
+
+      for (threads=1; ; threads=(threads * 2 < cfg.nthreads ? threads * 2 : cfg.nthreads))
+      {
+        pool = matmul_create(threads, cfg.pin ? MATMUL_PIN : 0);
+
+        for (variant=0; variant<BENCH_VARIANTS; variant++)
+        {
+          cfg.unpacked = variant != 0;
+          cfg.steal = variant == 2;
+
+          // one untimed multiply first, so page faults on C and cold caches are not
+          // charged to the run.
+          multiply(pool, NULL);
+          elapsed = multiply(pool, &pack);
+          if (threads == 1)
+            base[variant] = elapsed;
+
+          bad = check_product(cfg.verify ? 0 : SPOT_CHECKS);
+          failed |= bad;
+
+          printf("%d,%d,%d,%s,%s,%s,%d,%.6f,%.6f,%.3f,%.3f,%.3f,%d\n", m, k, n,
+                 cfg.type == MAT_INT32 ? "int32" : "float32", matmul_kernels(),
+                 variants[variant],
+                 threads, elapsed, pack, 2.0 * m * n * k / elapsed / 1e9,
+                 base[variant] / elapsed, base[variant] / elapsed / threads, bad);
+          fflush(stdout);
+        }
+
+        matmul_free(pool);
+
+        if (threads == cfg.nthreads)
+          break;
+      }
+    }
+
+    mat_close(&A);
+    mat_close(&B);
+    mat_close(&C);
+  }
+
+  free(list);
+
+  if (failed)
+  {
+    fprintf(stderr, "[ERROR]: some runs differ from CalcProduct\n");
+    return EXIT_FAILURE;
+  }
+
+  return 0;
+}
+
+/*
+ *
+ * Multiply two random size x size matrices through the int32 path and again with
+ * both operands narrowed to cfg.quant bits, and report the narrow product's time and
+ * operand bytes against int32's.  The narrow product must equal the int32 one, which
+ * is itself checked against CalcProduct.
+ *
+ */
+int run_quant(Pool *pool)
+{
+  const int size = cfg.size;
+  const int type = cfg.quant == 8 ? MAT_INT8 : MAT_INT16;
+  const int group = 4 / quant_size(type);
+  const int groups = (size + group - 1) / group;
+  PackedB pb;
+  int *aq, *ref;
+  double start, elapsed, elapsed32, pack, bytes, bytes32;
+  int r, bad;
+
+  if (select_quant(cfg.kernel))
+  {
+    printf("[ERROR]: cannot use the %s kernels\n", cfg.kernel);
+    exit(EXIT_FAILURE);
+  }
+
+  mat_alloc(&A, MAT_INT32, size, size);
+  mat_alloc(&B, MAT_INT32, size, size);
+  mat_alloc(&C, MAT_INT32, size, size);
+  mat_fill_random(&A);
+  mat_fill_random(&B);
+
+  elapsed32 = multiply(pool, NULL);
+  bytes32 = 2.0 * size * size * sizeof(int);
+  printf("int32 (%s): %.3f s, %.2f GOP/s, %.1f MB of operands\n", matmul_kernels(), elapsed32,
+         2.0 * size * size * size / elapsed32 / 1e9, bytes32 / 1048576.0);
+
+  ref = malloc((size_t) size * size * sizeof(int));
+  if (ref == NULL)
+  {
+    perror("[ERROR]");
+    exit(EXIT_FAILURE);
+  }
+  memcpy(ref, C.data, (size_t) size * size * sizeof(int));
+
+  aq = quant_a(type, size, size, MAT_I32(&A), size, groups);
+  start = now();
+  if (aq == NULL || quant_b(pool, &pb, type, size, size, MAT_I32(&B), size, groups))
+  {
+    printf("[ERROR]: operands do not fit in int%d\n", cfg.quant);
+    exit(EXIT_FAILURE);
+  }
+  pack = now() - start;
+
+  start = now();
+  for (r=0; r<cfg.repeats; r++)
+    gemm_packed(pool, size, aq, groups, &pb, C.data, C.cols);
+  elapsed = (now() - start) / cfg.repeats;
+
+  bytes = ((double) size * groups + (double) groups * size) * sizeof(int);
+  printf("int%d (%s): %.3f s, %.2f GOP/s, %.1f MB of operands, pack %.3f s\n",
+         cfg.quant, qkern.name, elapsed, 2.0 * size * size * size / elapsed / 1e9,
+         bytes / 1048576.0, pack);
+  printf("int%d gain: %.2fx throughput, %.2fx less operand traffic\n", cfg.quant,
+         elapsed32 / elapsed, bytes32 / bytes);
+
+  bad = memcmp(ref, C.data, (size_t) size * size * sizeof(int)) != 0;
+  if (bad)
+    printf("[ERROR]: int%d product differs from int32\n", cfg.quant);
+
+  memcpy(C.data, ref, (size_t) size * size * sizeof(int));
+  if (check_product(cfg.verify ? 0 : SPOT_CHECKS))
+  {
+    printf("[ERROR]: int32 product differs from CalcProduct\n");
+    bad = 1;
+  }
+
+  free_packed(&pb);
+  free(aq);
+  free(ref);
+  mat_close(&A);
+  mat_close(&B);
+  mat_close(&C);
+
+  return bad ? EXIT_FAILURE : 0;
+}
+
+/*
+ *
+ * Multiply a batch of cfg.batch random products of shape cfg.shape cfg.repeats times,
+ * and report the throughput.  Every product is checked against CalcProduct with -v,
+ * otherwise SPOT_CHECKS random products are.
+ *
+ */
+int run_batch(Pool *pool)
+{
+  const int count = cfg.batch;
+  Triple *batch;
+  Matrix a, b, c;
+  double start, elapsed;
+  int m = M, k = K, n = N;
+  int t, r, checks, bad = 0;
+
+  if (cfg.shape != NULL && (sscanf(cfg.shape, "%dx%dx%d", &m, &k, &n) != 3 ||
+                            m < 1 || k < 1 || n < 1))
+  {
+    printf("[ERROR]: expected <m>x<k>x<n>, got %s\n", cfg.shape);
+    exit(EXIT_FAILURE);
+  }
+
+  // the whole batch lives in three contiguous arrays.
+  mat_alloc(&a, cfg.type, count, m * k);
+  mat_alloc(&b, cfg.type, count, k * n);
+  mat_alloc(&c, cfg.type, count, m * n);
+  mat_fill_random(&a);
+  mat_fill_random(&b);
+
+  batch = malloc(count * sizeof(Triple));
+  if (batch == NULL)
+  {
+    perror("[ERROR]");
+    exit(EXIT_FAILURE);
+  }
+
+  for (t=0; t<count; t++)
+  {
+    batch[t].a = elem_at(a.data, a.type, t, a.cols, 0);
+    batch[t].b = elem_at(b.data, b.type, t, b.cols, 0);
+    batch[t].c = elem_at(c.data, c.type, t, c.cols, 0);
+  }
+
+  start = now();
+  for (r=0; r<cfg.repeats; r++)
+    matmul_multiply_batch(pool, cfg.type, m, n, k, batch, count, k, n, n);
+  elapsed = (now() - start) / cfg.repeats;
+
+  printf("%d products of %dx%d * %dx%d on %d threads: %.3f s, %.2f M products/s, "
+         "%.2f GOP/s\n", count, m, k, k, n, pool->nthreads, elapsed,
+         count / elapsed / 1e6, 2.0 * count * m * n * k / elapsed / 1e9);
+
+  // point A, B and C at one product at a time so CalcProduct can check it.
+  memset(&A, 0, sizeof(Matrix));
+  memset(&B, 0, sizeof(Matrix));
+  memset(&C, 0, sizeof(Matrix));
+  A.type = B.type = C.type = cfg.type;
+  A.rows = C.rows = m;
+  A.cols = B.rows = k;
+  B.cols = C.cols = n;
+
+  checks = cfg.verify ? count : (count < SPOT_CHECKS ? count : SPOT_CHECKS);
+  for (r=0; r<checks; r++)
+  {
+    t = cfg.verify ? r : rand() % count;
+    A.data = (void *) batch[t].a;
+    B.data = (void *) batch[t].b;
+    C.data = batch[t].c;
+    bad += check_product(0);
+  }
+
+  memset(&A, 0, sizeof(Matrix));
+  memset(&B, 0, sizeof(Matrix));
+  memset(&C, 0, sizeof(Matrix));
+
+  free(batch);
+  mat_close(&a);
+  mat_close(&b);
+  mat_close(&c);
+
+  if (bad)
+  {
+    printf("[ERROR]: %d elements of the batch differ from CalcProduct\n", bad);
+    return EXIT_FAILURE;
+  }
+
+  return 0;
+}
+
+/*
+ *
+ * Multiply a sparse (CSR) A by B on the worker pool, writing C to path.  A dense B
+ * gives a dense C.  For a sparse B the fill of C is estimated from the row lengths
+ * first: C is written dense if it is expected to be at least SPARSE_DENSE_FILL full,
+ * and as CSR otherwise.
+ *
+ */
+int run_sparse(Pool *pool, const char *path)
+{
+  SparseJob job;
+  double start, elapsed, fill = 1.0;
+  size_t est = 0, p;
+  int rc = 0;
+
+  memset(&job, 0, sizeof(SparseJob));
+  job.nthreads = pool->nthreads;
+
+  if (B.format == MAT_CSR)
+  {
+    // upper bound on nnz(C): every product term landing in a different column.
+    for (p=0; p<A.nnz; p++)
+      est += B.row_ptr[A.col_idx[p] + 1] - B.row_ptr[A.col_idx[p]];
+    fill = (double) est / ((double) A.rows * B.cols);
+  }
+
+  mat_print("Matrix A", cfg.print ? &A : NULL);
+  mat_print("Matrix B", cfg.print ? &B : NULL);
+
+  start = now();
+  if (B.format == MAT_DENSE || fill >= SPARSE_DENSE_FILL)
+  {
+    mat_create(&C, path, A.type, A.rows, B.cols);
+    sparse_run(pool, &job, B.format == MAT_DENSE ? SPARSE_SPMM : SPARSE_DENSE);
+  }
+  else
+  {
+    job.counts = malloc((A.rows + 1) * sizeof(int64_t));
+    job.marker = malloc((size_t) job.nthreads * B.cols * sizeof(int));
+    job.cols = malloc((size_t) job.nthreads * B.cols * sizeof(int));
+    job.accum = malloc((size_t) job.nthreads * B.cols * type_size(A.type));
+    if (job.counts == NULL || job.marker == NULL || job.cols == NULL || job.accum == NULL)
+    {
+      perror("[ERROR]");
+      exit(EXIT_FAILURE);
+    }
+
+    // symbolic pass: count each row of C, then size the output file exactly.
+    memset(job.marker, -1, (size_t) job.nthreads * B.cols * sizeof(int));
+    sparse_run(pool, &job, SPARSE_SYMBOLIC);
+
+    mat_create_sparse(&C, path, MAT_CSR, A.type, A.rows, B.cols, job.counts[A.rows]);
+    memcpy(C.row_ptr, job.counts, (A.rows + 1) * sizeof(int64_t));
+
+    memset(job.marker, -1, (size_t) job.nthreads * B.cols * sizeof(int));
+    sparse_run(pool, &job, SPARSE_NUMERIC);
+
+    free(job.counts);
+    free(job.marker);
+    free(job.cols);
+    free(job.accum);
+  }
+  elapsed = now() - start;
+
+  mat_print("Matrix C = AB", cfg.print ? &C : NULL);
+
+  printf("%dx%d (nnz %lu) * %dx%d (%s) on %d threads (%s): %.3f s, C is %s",
+         A.rows, A.cols, (unsigned long) A.nnz, B.rows, B.cols,
+         B.format == MAT_CSR ? "sparse" : "dense", pool->nthreads, matmul_kernels(), elapsed,
+         C.format == MAT_CSR ? "sparse" : "dense");
+  if (B.format == MAT_CSR)
+    printf(" (estimated fill %.3f)", fill < 1.0 ? fill : 1.0);
+  if (C.format == MAT_CSR)
+    printf(", nnz %lu", (unsigned long) C.nnz);
+  printf("\n");
+
+  if (cfg.verify)
+  {
+    int bad = check_product(0);
+    if (bad)
+    {
+      printf("[ERROR]: %d elements of C differ from CalcProduct\n", bad);
+      rc = EXIT_FAILURE;
+    }
+  }
+
+  return rc;
+}
+
+/*
+ *
+ * Out-of-core multiply of the mapped A and B into the mapped C at path, holding no
+ * more than about cfg.budget bytes of operands at once.  B gets up to half the budget
+ * as packed column panels; A is streamed in row panels sized to the rest together
+ * with the full-width C rows they produce, each C row panel being finished before the
+ * next starts.  While a panel computes, the kernel
+ * is asked to read ahead the next A panel, and finished A and C rows are dropped from
+ * the mapping with their writeback started, so the working set stays near the budget.
+ * If every B panel fits it is packed once, otherwise the panels are repacked for each
+ * A panel.
+ *
+ */
+int run_stream(Pool *pool, const char *path)
+{
+  const size_t esize = type_size(A.type);
+  const size_t budget = cfg.budget / esize;
+  const int m = A.rows, k = A.cols, n = B.cols;
+  PackedB *pb;
+  double start, elapsed;
+  size_t b_elems;
+  int wn, hm, panels, i0, j0, p, bad;
+
+  mat_create(&C, path, A.type, m, n);
+
+  // widest B panel (a multiple of TILE_N where possible, or all of n) that fits in half
+  // the budget.
+  wn = (int) ((budget / 2) / k);
+  if (wn > TILE_N)
+    wn = wn / TILE_N * TILE_N;
+  if (wn >= n)
+    wn = n;
+  if (wn < 1)
+    wn = 1;
+  panels = (n + wn - 1) / wn;
+  b_elems = (size_t) k * (wn < TILE_N ? wn : ((wn + TILE_N - 1) / TILE_N) * TILE_N);
+
+  // tallest A panel that fits alongside one B panel and the C rows it produces.  The C
+  // rows stay dirty in memory across all n columns until the panel is flushed, so
+  // they count in full, not just the tile of one B panel.
+  hm = 0;
+  if (wn > 0 && budget > b_elems)
+    hm = (int) ((budget - b_elems) / ((size_t) k + n));
+  if (hm > m)
+    hm = m;
+
+  if (hm < 1 || (size_t) k * wn > budget / 2)
+  {
+    printf("[ERROR]: a memory budget of %lu bytes is too small for k = %d, n = %d\n",
+           (unsigned long) cfg.budget, k, n);
+    exit(EXIT_FAILURE);
+  }
+
+  pb = calloc(panels, sizeof(PackedB));
+  if (pb == NULL)
+  {
+    perror("[ERROR]");
+    exit(EXIT_FAILURE);
+  }
+
+  start = now();
+
+  // B is read sequentially when packing and never needed again once it is packed.
+  madvise(B.map, B.map_len, MADV_SEQUENTIAL);
+
+  if (panels == 1 || (size_t) panels * b_elems <= budget / 2)
+    for (p=0; p<panels; p++)
+      pack_b(pool, &pb[p], B.type, k, (p + 1) * wn < n ? wn : n - p * wn,
+             elem_at(B.data, B.type, 0, n, (size_t) p * wn), n);
+
+  for (i0=0; i0<m; i0+=hm)
+  {
+    const int rows = (i0 + hm < m) ? hm : m - i0;
+
+    // start reading the next A panel while this one computes.
+    if (i0 + rows < m)
+      map_advise(&A, elem_at(A.data, A.type, i0 + rows, k, 0),
+                 (size_t) (i0 + 2 * rows < m ? rows : m - i0 - rows) * k * esize,
+                 MADV_WILLNEED);
+
+    for (j0=0, p=0; j0<n; j0+=wn, p++)
+    {
+      if (pb[p].data == NULL)
+        pack_b(pool, &pb[p], B.type, k, (j0 + wn < n) ? wn : n - j0,
+               elem_at(B.data, B.type, 0, n, j0), n);
+
+      gemm_packed(pool, rows, elem_at(A.data, A.type, i0, k, 0), k, &pb[p],
+                  elem_at(C.data, C.type, i0, n, j0), n);
+
+      if (panels > 1 && (size_t) panels * b_elems > budget / 2)
+        free_packed(&pb[p]);
+    }
+
+    // the A panel is done, and the C rows can go to disk.
+    map_advise(&A, elem_at(A.data, A.type, i0, k, 0), (size_t) rows * k * esize,
+               MADV_DONTNEED);
+    map_advise(&C, elem_at(C.data, C.type, i0, n, 0), (size_t) rows * n * esize,
+               MADV_DONTNEED);
+  }
+
+  for (p=0; p<panels; p++)
+    free_packed(&pb[p]);
+  free(pb);
+
+  elapsed = now() - start;
+
+  printf("%dx%d * %dx%d streamed on %d threads (%s): %d-row A panels, %d-column B panels, "
+         "%.3f s, %.2f GOP/s\n", m, k, k, n, pool->nthreads, matmul_kernels(), hm, wn, elapsed,
+         2.0 * m * n * k / elapsed / 1e9);
+
+  bad = check_product(cfg.verify ? 0 : SPOT_CHECKS);
+  if (bad)
+  {
+    printf("[ERROR]: %d elements of C differ from CalcProduct\n", bad);
+    return EXIT_FAILURE;
+  }
+
+  return 0;
+}
+
+/*
+ *
+ * Apply madvise to the whole pages inside [addr, addr + len) of a mapped matrix.  For
+ * MADV_DONTNEED on a writable mapping, writeback of the range is started first.  Only
+ * whole pages are used so neighbouring panels are never affected.
+ *
+ */
+void map_advise(const Matrix *mat, const void *addr, size_t len, int advice)
+{
+  const uintptr_t page = (uintptr_t) sysconf(_SC_PAGESIZE);
+  uintptr_t lo = (uintptr_t) addr;
+  uintptr_t hi = lo + len;
+
+  if (mat->map == NULL)
+    return;
+
+  // WILLNEED may round outward; DONTNEED must round inward.
+  if (advice == MADV_WILLNEED)
+  {
+    lo = lo / page * page;
+    hi = (hi + page - 1) / page * page;
+  }
+  else
+  {
+    lo = (lo + page - 1) / page * page;
+    hi = hi / page * page;
+  }
+
+  if (hi <= lo)
+    return;
+
+  if (advice == MADV_DONTNEED && msync((void *) lo, hi - lo, MS_ASYNC) == -1)
+    perror("[ERROR]");
+
+  if (madvise((void *) lo, hi - lo, advice) == -1)
+    perror("[ERROR]");
+}
+
+/*
+ *
+ * Multiply the chain of count dense matrix files paths[0] ... paths[count-1] and write
+ * the product to paths[count].  The chain is evaluated in the cheapest order (see
+ * chain_order), with products that do not depend on each other computed together in
+ * rounds, and intermediate results live in buffers that are recycled between rounds.
+ *
+ */
+int run_chain(Pool *pool, char **paths, int count)
+{
+  Chain ch;
+  Matrix *ops;
+  int *dims, *split;
+  long long cost, naive = 0;
+  double start, elapsed;
+  int i, root, bad, rc = 0;
+
+  ops = calloc(count, sizeof(Matrix));
+  dims = malloc((count + 1) * sizeof(int));
+  split = malloc(count * count * sizeof(int));
+  memset(&ch, 0, sizeof(Chain));
+  ch.node = calloc(2 * count - 1, sizeof(ChainNode));
+  ch.free_buf = malloc(count * sizeof(void *));
+  ch.free_bytes = malloc(count * sizeof(size_t));
+  if (ops == NULL || dims == NULL || split == NULL || ch.node == NULL ||
+      ch.free_buf == NULL || ch.free_bytes == NULL)
+  {
+    perror("[ERROR]");
+    exit(EXIT_FAILURE);
+  }
+
+  for (i=0; i<count; i++)
+  {
+    mat_open(&ops[i], paths[i]);
+
+    if (ops[i].format != MAT_DENSE || ops[i].type != ops[0].type ||
+        (i > 0 && ops[i].rows != ops[i-1].cols))
+    {
+      printf("[ERROR]: %s does not continue the chain of dense matrices\n", paths[i]);
+      exit(EXIT_FAILURE);
+    }
+
+    dims[i] = ops[i].rows;
+    ch.node[i].left = ch.node[i].right = -1;
+    ch.node[i].rows = ops[i].rows;
+    ch.node[i].cols = ops[i].cols;
+    ch.node[i].data = ops[i].data;
+  }
+  dims[count] = ops[count-1].cols;
+
+  ch.count = count;
+  ch.type = ops[0].type;
+  ch.nodes = count;
+
+  cost = chain_order(dims, count, split);
+  root = chain_build(&ch, split, 0, count - 1);
+  for (i=1; i<count; i++)
+    naive += (long long) dims[0] * dims[i] * dims[i+1];
+
+  mat_create(&C, paths[count], ch.type, dims[0], dims[count]);
+  ch.node[root].data = C.data;
+
+  printf("order: ");
+  chain_print(&ch, root);
+  printf("\n%lld multiply-adds in %d rounds (%lld left to right)\n", cost,
+         ch.node[root].round, naive);
+
+  start = now();
+  chain_run(pool, &ch, root);
+  elapsed = now() - start;
+
+  printf("chain of %d on %d threads (%s): %.3f s, %.2f GOP/s\n", count, pool->nthreads,
+         matmul_kernels(), elapsed, 2.0 * cost / elapsed / 1e9);
+  printf("intermediates: %.1f MB peak in %d buffers (%.1f MB without reuse)\n",
+         ch.peak / 1048576.0, ch.buffers, ch.total / 1048576.0);
+
+  bad = chain_check(&ch, ops, cfg.verify ? dims[0] : SPOT_CHECKS);
+  if (bad)
+  {
+    printf("[ERROR]: %d rows of the product differ from the reference\n", bad);
+    rc = EXIT_FAILURE;
+  }
+
+  for (i=0; i<ch.nfree; i++)
+    free(ch.free_buf[i]);
+  for (i=0; i<count; i++)
+    mat_close(&ops[i]);
+  mat_close(&C);
+  free(ch.node);
+  free(ch.free_buf);
+  free(ch.free_bytes);
+  free(split);
+  free(dims);
+  free(ops);
+
+  return rc;
+}
+
+/*
+ *
+ * Find the cheapest parenthesization of a chain of count matrices, matrix i being
+ * dims[i] x dims[i+1], by the usual O(count^3) dynamic program.  split[i*count+j] is
+ * set to the last matrix of the left factor of the product i..j.  Returns the number
+ * of multiply-adds of the whole chain.
+ *
+ */
+long long chain_order(const int *dims, int count, int *split)
+{
+  long long *cost;
+  long long c, best;
+  int len, i, j, s;
+
+  cost = calloc(count * count, sizeof(long long));
+  if (cost == NULL)
+  {
+    perror("[ERROR]");
+    exit(EXIT_FAILURE);
+  }
+
+  for (len=2; len<=count; len++)
+  {
+    for (i=0; i+len<=count; i++)
+    {
+      j = i + len - 1;
+      best = -1;
+
+      for (s=i; s<j; s++)
+      {
+        c = cost[i * count + s] + cost[(s + 1) * count + j] +
+            (long long) dims[i] * dims[s+1] * dims[j+1];
+        if (best < 0 || c < best)
+        {
+          best = c;
+          split[i * count + j] = s;
+        }
+      }
+
+      cost[i * count + j] = best;
+    }
+  }
+
+  best = cost[count - 1];
+  free(cost);
+
+  return best;
+}
+
+/*
+ *
+ * Add the nodes for the product of operands i..j to ch, following split, and return
+ * the index of its root.  A product's round is one more than its later operand's, so
+ * every product of a round only needs results of earlier rounds.
+ *
+ */
+int chain_build(Chain *ch, const int *split, int i, int j)
+{
+  ChainNode *node;
+  int left, right;
+
+  if (i == j)
+    return i;
+
+  left = chain_build(ch, split, i, split[i * ch->count + j]);
+  right = chain_build(ch, split, split[i * ch->count + j] + 1, j);
+
+  node = &ch->node[ch->nodes];
+  node->left = left;
+  node->right = right;
+  node->rows = ch->node[left].rows;
+  node->cols = ch->node[right].cols;
+  node->round = 1 + (ch->node[left].round > ch->node[right].round ?
+                     ch->node[left].round : ch->node[right].round);
+
+  return ch->nodes++;
+}
+
+/*
+ *
+ * Print the parenthesization rooted at node, operands numbered from 1.
+ *
+ */
+void chain_print(const Chain *ch, int node)
+{
+  if (ch->node[node].left < 0)
+  {
+    printf("A%d", node + 1);
+    return;
+  }
+
+  printf("(");
+  chain_print(ch, ch->node[node].left);
+  printf(" ");
+  chain_print(ch, ch->node[node].right);
+  printf(")");
+}
+
+/*
+ *
+ * Evaluate the products of ch round by round.  All the products of a round are posted
+ * as one pool job whose tiles are claimed across every product, so small independent
+ * products share the workers instead of running one after another.  After a round
+ * the intermediates it consumed go back to the free list for later rounds.
+ *
+ */
+void chain_run(Pool *pool, Chain *ch, int root)
+{
+  ChainJob job;
+  ChainNode *node;
+  int round, i, side, child;
+
+  job.gemm = malloc(ch->count * sizeof(Gemm *));
+  job.first = malloc(ch->count * sizeof(int));
+  if (job.gemm == NULL || job.first == NULL)
+  {
+    perror("[ERROR]");
+    exit(EXIT_FAILURE);
+  }
+
+  for (round=1; round<=ch->node[root].round; round++)
+  {
+    job.count = 0;
+    job.ntiles = 0;
+    job.next = 0;
+
+    for (i=ch->count; i<ch->nodes; i++)
+    {
+      node = &ch->node[i];
+      if (node->round != round)
+        continue;
+
+      if (i != root)
+      {
+        node->bytes = (size_t) node->rows * node->cols * type_size(ch->type);
+        node->data = chain_alloc(ch, &node->bytes);
+      }
+
+      memset(&node->g, 0, sizeof(Gemm));
+      node->g.type = ch->type;
+      node->g.m = node->rows;
+      node->g.n = node->cols;
+      node->g.k = ch->node[node->left].cols;
+      node->g.a = ch->node[node->left].data;
+      node->g.b = ch->node[node->right].data;
+      node->g.c = node->data;
+      node->g.lda = ch->node[node->left].cols;
+      node->g.ldb = node->cols;
+      node->g.ldc = node->cols;
+      node->g.panel_stride = TILE_N;
+      node->g.tiles_n = (node->g.n + TILE_N - 1) / TILE_N;
+      node->g.ntiles = ((node->g.m + TILE_M - 1) / TILE_M) * node->g.tiles_n;
+
+      job.gemm[job.count] = &node->g;
+      job.first[job.count++] = job.ntiles;
+      job.ntiles += node->g.ntiles;
+    }
+
+    pool_run(pool, chain_worker, &job);
+
+    for (i=ch->count; i<ch->nodes; i++)
+    {
+      if (ch->node[i].round != round)
+        continue;
+
+      for (side=0; side<2; side++)
+      {
+        child = side ? ch->node[i].right : ch->node[i].left;
+        if (child >= ch->count)
+          chain_release(ch, ch->node[child].data, ch->node[child].bytes);
+      }
+    }
+  }
+
+  free(job.gemm);
+  free(job.first);
+}
+
+/*
+ *
+ * Pool job for chain_run: claim tiles from the round's combined numbering until none
+ * are left, and compute each in the product it belongs to.
+ *
+ */
+void chain_worker(void *arg, int id)
+{
+  ChainJob *job = (ChainJob *) arg;
+  int t, g;
+
+  (void) id;
+
+  while ((t = __sync_fetch_and_add(&job->next, 1)) < job->ntiles)
+  {
+    for (g=job->count-1; job->first[g] > t; g--)
+      ;
+    gemm_tile(job->gemm[g], t - job->first[g]);
+  }
+}
+
+/*
+ *
+ * Return a buffer of at least *bytes for an intermediate product: the smallest large
+ * enough buffer on the free list, or else a new one.  *bytes is set to the size of the
+ * buffer returned, which is what chain_release must be given back.
+ *
+ */
+void *chain_alloc(Chain *ch, size_t *bytes)
+{
+  void *buf;
+  int i, best = -1;
+
+  for (i=0; i<ch->nfree; i++)
+    if (ch->free_bytes[i] >= *bytes &&
+        (best < 0 || ch->free_bytes[i] < ch->free_bytes[best]))
+      best = i;
+
+  ch->total += *bytes;
+
+  if (best >= 0)
+  {
+    buf = ch->free_buf[best];
+    *bytes = ch->free_bytes[best];
+    ch->free_buf[best] = ch->free_buf[--ch->nfree];
+    ch->free_bytes[best] = ch->free_bytes[ch->nfree];
+    return buf;
+  }
+
+  if (posix_memalign(&buf, 64, *bytes))
+  {
+    perror("[ERROR]");
+    exit(EXIT_FAILURE);
+  }
+
+  ch->peak += *bytes;
+  ch->buffers++;
+
+  return buf;
+}
+
+/*
+ *
+ * Put an intermediate's buffer of the given size back on the free list.
+ *
+ */
+void chain_release(Chain *ch, void *buf, size_t bytes)
+{
+  ch->free_buf[ch->nfree] = buf;
+  ch->free_bytes[ch->nfree++] = bytes;
+}
+
+/*
+ *
+ * Check rows of C against a reference that pushes each row of the first operand
+ * through the rest of the chain one vector at a time, in int32 (wrapping, as the
+ * kernels do) or double.  rows is the number of random rows, or every row when it is
+ * C.rows.  float32 rows are compared relative to their largest element.  Returns the
+ * number of rows that differ.
+ *
+ */
+int chain_check(const Chain *ch, const Matrix *ops, int rows)
+{
+  double *row, *next, scale, diff;
+  int r, i, c, j, width, bad = 0;
+  size_t x;
+
+  for (i=0, width=0; i<ch->count; i++)
+    if (ops[i].cols > width)
+      width = ops[i].cols;
+
+  row = malloc(width * sizeof(double));
+  next = malloc(width * sizeof(double));
+  if (row == NULL || next == NULL)
+  {
+    perror("[ERROR]");
+    exit(EXIT_FAILURE);
+  }
+
+  for (r=0; r<rows; r++)
+  {
+    x = rows == C.rows ? r : rand() % C.rows;
+
+    for (c=0; c<ops[0].cols; c++)
+      row[c] = ch->type == MAT_INT32 ? (double) MAT_I32(&ops[0])[x * ops[0].cols + c] :
+                                       MAT_F32(&ops[0])[x * ops[0].cols + c];
+
+    for (i=1; i<ch->count; i++)
+    {
+      for (j=0; j<ops[i].cols; j++)
+      {
+        unsigned int isum = 0;
+        double fsum = 0;
+
+        for (c=0; c<ops[i].rows; c++)
+        {
+          if (ch->type == MAT_INT32)
+            isum += (unsigned int) (int) row[c] *
+                    (unsigned int) MAT_I32(&ops[i])[(size_t) c * ops[i].cols + j];
+          else
+            fsum += row[c] * MAT_F32(&ops[i])[(size_t) c * ops[i].cols + j];
+        }
+
+        next[j] = ch->type == MAT_INT32 ? (double) (int) isum : fsum;
+      }
+
+      memcpy(row, next, ops[i].cols * sizeof(double));
+    }
+
+    scale = 1.0;
+    for (c=0; c<C.cols; c++)
+      if (row[c] > scale || -row[c] > scale)
+        scale = row[c] < 0 ? -row[c] : row[c];
+
+    for (c=0; c<C.cols; c++)
+    {
+      if (ch->type == MAT_INT32)
+        diff = MAT_I32(&C)[x * C.cols + c] != (int) row[c];
+      else
+        diff = (MAT_F32(&C)[x * C.cols + c] - row[c]) / scale;
+
+      if (diff > FLOAT_TOL || -diff > FLOAT_TOL)
+      {
+        bad++;
+        break;
+      }
+    }
+  }
+
+  free(row);
+  free(next);
+
+  return bad;
+}
+
+/*
+ *
+ * Run one phase of a sparse product over the rows of A on the pool.  For the symbolic
+ * phase, job->counts ends up holding the row offsets of C.
+ *
+ */
+void sparse_run(Pool *pool, SparseJob *job, int phase)
+{
+  int i;
+
+  job->phase = phase;
+  job->next = 0;
+  pool_run(pool, sparse_worker, job);
+
+  if (phase != SPARSE_SYMBOLIC)
+    return;
+
+  // turn the per-row counts into offsets.
+  for (i=A.rows; i>0; i--)
+    job->counts[i] = job->counts[i-1];
+  job->counts[0] = 0;
+  for (i=0; i<A.rows; i++)
+    job->counts[i+1] += job->counts[i];
+}
+
+/*
+ *
+ * Pool job for sparse_run: claim SPARSE_CHUNK rows of A at a time and compute those
+ * rows of C.  Sparse-by-sparse products use Gustavson's row-by-row method, with
+ * marker recording which columns the current row has touched.
+ *
+ */
+void sparse_worker(void *arg, int id)
+{
+  SparseJob *job = (SparseJob *) arg;
+  const int n = B.cols;
+  int *marker = job->marker + (size_t) id * n;
+  int *cols = job->cols + (size_t) id * n;
+  int row0, i, j, count;
+  int64_t p, q, out;
+
+  while ((row0 = __sync_fetch_and_add(&job->next, SPARSE_CHUNK)) < A.rows)
+  {
+    const int row1 = (row0 + SPARSE_CHUNK < A.rows) ? row0 + SPARSE_CHUNK : A.rows;
+
+    for (i=row0; i<row1; i++)
+    {
+      if (job->phase == SPARSE_SPMM || job->phase == SPARSE_DENSE)
+        memset(elem_at(C.data, C.type, i, n, 0), 0, n * type_size(C.type));
+
+      switch (job->phase)
+      {
+        // row i of C is a sum of rows of the dense B, one axpy per nonzero of A.
+        case SPARSE_SPMM:
+          for (p=A.row_ptr[i]; p<A.row_ptr[i+1]; p++)
+          {
+            if (A.type == MAT_INT32)
+              kern.axpy_i32(MAT_I32(&C) + (size_t) i * n, MAT_I32(&A)[p],
+                            MAT_I32(&B) + (size_t) A.col_idx[p] * n, n);
+            else
+              kern.axpy_f32(MAT_F32(&C) + (size_t) i * n, MAT_F32(&A)[p],
+                            MAT_F32(&B) + (size_t) A.col_idx[p] * n, n);
+          }
+          break;
+
+        case SPARSE_DENSE:
+          for (p=A.row_ptr[i]; p<A.row_ptr[i+1]; p++)
+          {
+            const int x = A.col_idx[p];
+
+            for (q=B.row_ptr[x]; q<B.row_ptr[x+1]; q++)
+            {
+              const size_t idx = (size_t) i * n + B.col_idx[q];
+
+              if (A.type == MAT_INT32)
+                MAT_I32(&C)[idx] += MAT_I32(&A)[p] * MAT_I32(&B)[q];
+              else
+                MAT_F32(&C)[idx] += MAT_F32(&A)[p] * MAT_F32(&B)[q];
+            }
+          }
+          break;
+
+        case SPARSE_SYMBOLIC:
+        case SPARSE_NUMERIC:
+          count = 0;
+          for (p=A.row_ptr[i]; p<A.row_ptr[i+1]; p++)
+          {
+            const int x = A.col_idx[p];
+
+            for (q=B.row_ptr[x]; q<B.row_ptr[x+1]; q++)
+            {
+              j = B.col_idx[q];
+              if (marker[j] != i)
+              {
+                marker[j] = i;
+                cols[count++] = j;
+                if (job->phase == SPARSE_SYMBOLIC)
+                  continue;
+                if (A.type == MAT_INT32)
+                  ((int *) job->accum)[(size_t) id * n + j] = 0;
+                else
+                  ((float *) job->accum)[(size_t) id * n + j] = 0;
+              }
+
+              if (job->phase == SPARSE_SYMBOLIC)
+                continue;
+              if (A.type == MAT_INT32)
+                ((int *) job->accum)[(size_t) id * n + j] += MAT_I32(&A)[p] * MAT_I32(&B)[q];
+              else
+                ((float *) job->accum)[(size_t) id * n + j] += MAT_F32(&A)[p] * MAT_F32(&B)[q];
+            }
+          }
+
+          if (job->phase == SPARSE_SYMBOLIC)
+          {
+            job->counts[i] = count;
+            break;
+          }
+
+          out = C.row_ptr[i];
+          for (j=0; j<count; j++, out++)
+          {
+            C.col_idx[out] = cols[j];
+            if (A.type == MAT_INT32)
+              MAT_I32(&C)[out] = ((int *) job->accum)[(size_t) id * n + cols[j]];
+            else
+              MAT_F32(&C)[out] = ((float *) job->accum)[(size_t) id * n + cols[j]];
+          }
+          break;
+      }
+    }
+  }
+}
+
+/*
+ *
+ * Index into mat->data of element (row, col), or -1 if a sparse matrix has no entry
+ * there.  Used by the reference and debug paths, so a linear scan of the row is fine.
+ *
+ */
+long mat_find(const Matrix *mat, int row, int col)
+{
+  int64_t p;
+
+  if (mat->format == MAT_DENSE)
+    return (long) row * mat->cols + col;
+
+  for (p=mat->row_ptr[row]; p<mat->row_ptr[row+1]; p++)
+    if (mat->col_idx[p] == col)
+      return (long) p;
+
+  return -1;
+}
+
+/*
+ *
+ * Replace the mapped COO arrays of mat with heap CSR arrays: count the entries of each
+ * row, turn the counts into offsets, then scatter the entries into place.  Returns -1,
+ * leaving mat alone, if any row or column index is out of range.
+ *
+ */
+int coo_to_csr(Matrix *mat, const int *row_idx, const int *col_idx, const void *values)
+{
+  const size_t esize = type_size(mat->type);
+  int64_t *next;
+  size_t p;
+  int i;
+
+  // the indices are used to write into the new arrays, so they must be checked first.
+  if (!indices_valid(row_idx, mat->nnz, mat->rows) ||
+      !indices_valid(col_idx, mat->nnz, mat->cols))
+    return -1;
+
+  mat->row_ptr = calloc(mat->rows + 1, sizeof(int64_t));
+  next = malloc((mat->rows + 1) * sizeof(int64_t));
+  mat->col_idx = malloc(mat->nnz * sizeof(int));
+  mat->data = malloc(mat->nnz * esize);
+  if (mat->row_ptr == NULL || next == NULL || mat->col_idx == NULL || mat->data == NULL)
+  {
+    perror("[ERROR]");
+    exit(EXIT_FAILURE);
+  }
+
+  for (p=0; p<mat->nnz; p++)
+    mat->row_ptr[row_idx[p] + 1]++;
+  for (i=0; i<mat->rows; i++)
+    mat->row_ptr[i+1] += mat->row_ptr[i];
+
+  memcpy(next, mat->row_ptr, (mat->rows + 1) * sizeof(int64_t));
+  for (p=0; p<mat->nnz; p++)
+  {
+    const int64_t dst = next[row_idx[p]]++;
+
+    mat->col_idx[dst] = col_idx[p];
+    memcpy((char *) mat->data + dst * esize, (const char *) values + p * esize, esize);
+  }
+
+  free(next);
+  mat->format = MAT_CSR;
+  mat->owned = 1;
+
+  return 0;
+}
+
+/*
+ *
+ * Whether all count indices in idx lie in [0, limit).
+ *
+ */
+int indices_valid(const int *idx, size_t count, int limit)
+{
+  size_t p;
+
+  for (p=0; p<count; p++)
+    if (idx[p] < 0 || idx[p] >= limit)
+      return 0;
+
+  return 1;
+}
+
+/*
+ *
+ * Whether the CSR arrays of mat are consistent: row offsets that start at 0, never
+ * decrease and end at nnz, and column indices in range.
+ *
+ */
+int csr_valid(const Matrix *mat)
+{
+  int i;
+
+  if (mat->row_ptr[0] != 0 || mat->row_ptr[mat->rows] != (int64_t) mat->nnz)
+    return 0;
+
+  for (i=0; i<mat->rows; i++)
+    if (mat->row_ptr[i+1] < mat->row_ptr[i])
+      return 0;
+
+  return indices_valid(mat->col_idx, mat->nnz, mat->cols);
+}
+
+/*
+ *
+ * Byte size of a matrix file with the given shape, and the offsets of its arrays: for
+ * CSR, int64 row offsets then int32 columns then values; for COO, int32 rows then
+ * int32 columns then values; for dense, just the values.
+ *
+ */
+size_t mat_layout(int format, int type, int rows, int cols, size_t nnz, size_t *idx_off,
+                  size_t *val_off)
+{
+  switch (format)
+  {
+    case MAT_CSR:
+      *idx_off = MAT_HEADER_SIZE + ((size_t) rows + 1) * sizeof(int64_t);
+      *val_off = *idx_off + nnz * sizeof(int);
+      return *val_off + nnz * type_size(type);
+    case MAT_COO:
+      *idx_off = MAT_HEADER_SIZE + nnz * sizeof(int);
+      *val_off = *idx_off + nnz * sizeof(int);
+      return *val_off + nnz * type_size(type);
+    default:
+      *idx_off = MAT_HEADER_SIZE;
+      *val_off = MAT_HEADER_SIZE;
+      return MAT_HEADER_SIZE + (size_t) rows * cols * type_size(type);
+  }
+}
+
+/*
+ *
+ * Allocate an uninitialized rows x cols matrix on the heap.
+ *
+ */
+void mat_alloc(Matrix *mat, int type, int rows, int cols)
+{
+  memset(mat, 0, sizeof(Matrix));
+  mat->type = type;
+  mat->rows = rows;
+  mat->cols = cols;
+  mat->fd = -1;
+  mat->data = malloc((size_t) rows * cols * type_size(type));
+  if (mat->data == NULL)
+  {
+    perror("[ERROR]");
+    exit(EXIT_FAILURE);
+  }
+}
+
+/*
+ *
+ * Map a matrix file read-only.  The elements are used in place, with no copy.
+ *
+ */
+void mat_open(Matrix *mat, const char *path)
+{
+  struct stat st;
+  const MatHeader *hdr;
+  size_t idx_off, val_off, room, entry;
+  uint64_t elems;
+
+  memset(mat, 0, sizeof(Matrix));
+  mat->fd = open(path, O_RDONLY);
+  if (mat->fd == -1 || fstat(mat->fd, &st) == -1)
+  {
+    perror(path);
+    exit(EXIT_FAILURE);
+  }
+
+  if ((size_t) st.st_size < MAT_HEADER_SIZE)
+  {
+    printf("[ERROR]: %s is not a matrix file\n", path);
+    exit(EXIT_FAILURE);
+  }
+
+  mat->map_len = st.st_size;
+  mat->map = mmap(NULL, mat->map_len, PROT_READ, MAP_SHARED, mat->fd, 0);
+  if (mat->map == MAP_FAILED)
+  {
+    perror(path);
+    exit(EXIT_FAILURE);
+  }
+
+  hdr = (const MatHeader *) mat->map;
+  if (memcmp(hdr->magic, MAT_MAGIC, 4) != 0 ||
+      (hdr->type != MAT_INT32 && hdr->type != MAT_FLOAT32) || hdr->format > MAT_COO ||
+      hdr->rows == 0 || hdr->cols == 0 || hdr->rows > INT32_MAX || hdr->cols > INT32_MAX)
+  {
+    printf("[ERROR]: %s is not a valid matrix file\n", path);
+    exit(EXIT_FAILURE);
+  }
+
+  // nnz comes straight from the file, so it is bounded by the shape and by what the
+  // file can hold (a value and one index per entry, two for COO) before mat_layout
+  // multiplies it; the dense element count likewise.  Then no size can wrap.
+  room = mat->map_len - MAT_HEADER_SIZE;
+  elems = (uint64_t) hdr->rows * hdr->cols;
+  entry = (hdr->format == MAT_COO ? 2 : 1) * sizeof(int) + type_size(hdr->type);
+  if ((hdr->format == MAT_DENSE ? elems > room / type_size(hdr->type) :
+       hdr->nnz > elems || hdr->nnz > room / entry) ||
+      mat->map_len < mat_layout(hdr->format, hdr->type, hdr->rows, hdr->cols, hdr->nnz,
+                                &idx_off, &val_off))
+  {
+    printf("[ERROR]: %s is not a valid matrix file\n", path);
+    exit(EXIT_FAILURE);
+  }
+
+  mat->type = hdr->type;
+  mat->format = hdr->format;
+  mat->rows = (int) hdr->rows;
+  mat->cols = (int) hdr->cols;
+  mat->nnz = hdr->format == MAT_DENSE ? 0 : hdr->nnz;
+  mat->data = (char *) mat->map + val_off;
+
+  // the kernels trust the sparse indices, so a file with bad ones is rejected here.
+  if (mat->format == MAT_CSR)
+  {
+    mat->row_ptr = (int64_t *) ((char *) mat->map + MAT_HEADER_SIZE);
+    mat->col_idx = (int *) ((char *) mat->map + idx_off);
+    if (!csr_valid(mat))
+    {
+      printf("[ERROR]: %s has invalid sparse indices\n", path);
+      exit(EXIT_FAILURE);
+    }
+  }
+  else if (mat->format == MAT_COO &&
+           coo_to_csr(mat, (const int *) ((char *) mat->map + MAT_HEADER_SIZE),
+                      (const int *) ((char *) mat->map + idx_off), mat->data))
+  {
+    printf("[ERROR]: %s has invalid sparse indices\n", path);
+    exit(EXIT_FAILURE);
+  }
+}
+
+/*
+ *
+ * Create (or truncate) a rows x cols matrix file and map it read-write.  The header is
+ * filled in; the caller writes the elements directly into the mapping.
+ *
+ */
+void mat_create(Matrix *mat, const char *path, int type, int rows, int cols)
+{
+  MatHeader *hdr;
+
+  memset(mat, 0, sizeof(Matrix));
+  mat->map_len = MAT_HEADER_SIZE + (size_t) rows * cols * type_size(type);
+  mat->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+  if (mat->fd == -1 || ftruncate(mat->fd, mat->map_len) == -1)
+  {
+    perror(path);
+    exit(EXIT_FAILURE);
+  }
+
+  mat->map = mmap(NULL, mat->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, mat->fd, 0);
+  if (mat->map == MAP_FAILED)
+  {
+    perror(path);
+    exit(EXIT_FAILURE);
+  }
+
+  hdr = (MatHeader *) mat->map;
+  memcpy(hdr->magic, MAT_MAGIC, 4);
+  hdr->type = type;
+  hdr->rows = rows;
+  hdr->cols = cols;
+
+  mat->type = type;
+  mat->rows = rows;
+  mat->cols = cols;
+  mat->data = (char *) mat->map + MAT_HEADER_SIZE;
+}
+
+/*
+ *
+ * Create (or truncate) a CSR or COO matrix file with room for nnz entries and map it
+ * read-write.  The caller fills in the arrays.
+ *
+ */
+void mat_create_sparse(Matrix *mat, const char *path, int format, int type, int rows,
+                       int cols, size_t nnz)
+{
+  MatHeader *hdr;
+  size_t idx_off, val_off;
+
+  memset(mat, 0, sizeof(Matrix));
+  mat->map_len = mat_layout(format, type, rows, cols, nnz, &idx_off, &val_off);
+  mat->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+  if (mat->fd == -1 || ftruncate(mat->fd, mat->map_len) == -1)
+  {
+    perror(path);
+    exit(EXIT_FAILURE);
+  }
+
+  mat->map = mmap(NULL, mat->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, mat->fd, 0);
+  if (mat->map == MAP_FAILED)
+  {
+    perror(path);
+    exit(EXIT_FAILURE);
+  }
+
+  hdr = (MatHeader *) mat->map;
+  memcpy(hdr->magic, MAT_MAGIC, 4);
+  hdr->type = type;
+  hdr->format = format;
+  hdr->rows = rows;
+  hdr->cols = cols;
+  hdr->nnz = nnz;
+
+  mat->type = type;
+  mat->format = format;
+  mat->rows = rows;
+  mat->cols = cols;
+  mat->nnz = nnz;
+  mat->row_ptr = (int64_t *) ((char *) mat->map + MAT_HEADER_SIZE);
+  mat->col_idx = (int *) ((char *) mat->map + idx_off);
+  mat->data = (char *) mat->map + val_off;
+}
+
+/*
+ *
+ * Release a matrix.  Mapped files are unmapped, which leaves any writes in the file.
+ *
+ */
+void mat_close(Matrix *mat)
+{
+  if (mat->owned)
+  {
+    free(mat->row_ptr);
+    free(mat->col_idx);
+    free(mat->data);
+  }
+
+  if (mat->map != NULL)
+  {
+    if (munmap(mat->map, mat->map_len) == -1)
+      perror("[ERROR]");
+    close(mat->fd);
+  }
+  else if (!mat->owned)
+    free(mat->data);
+
+  memset(mat, 0, sizeof(Matrix));
+}
+
+/*
+ *
+ * Debug output: print a matrix if it is small enough to read.  Does nothing when mat
+ * is NULL so callers can pass their print flag through.
+ *
+ */
+void mat_print(const char *name, const Matrix *mat)
+{
+  int i, j;
+
+  if (mat == NULL)
+    return;
+
+  if (mat->rows > PRINT_MAX || mat->cols > PRINT_MAX)
+  {
+    printf("%s: %dx%d, too large to print\n\n", name, mat->rows, mat->cols);
+    return;
+  }
+
+  printf("%s:\n", name);
+  for (i=0; i<mat->rows; i++)
+  {
+    for (j=0; j<mat->cols; j++)
+    {
+      const long idx = mat_find(mat, i, j);
+
+      if (idx < 0)
+        printf("0 ");
+      else if (mat->type == MAT_INT32)
+        printf("%d ", MAT_I32(mat)[idx]);
+      else
+        printf("%g ", MAT_F32(mat)[idx]);
+    }
+
+    printf("\n");
+  }
+  printf("\n");
+}
+
+/*
+ *
+ * Fill a matrix with random values.  ints are kept small so the sums cannot overflow
+ * for any practical size; floats are uniform in [-1, 1].
+ *
+ */
+void mat_fill_random(Matrix *mat)
+{
+  const size_t elems = (size_t) mat->rows * mat->cols;
+  size_t s;
+
+  for (s=0; s<elems; s++)
+  {
+    if (mat->type == MAT_INT32)
+      MAT_I32(mat)[s] = rand() % 7 - 3;
+    else
+      MAT_F32(mat)[s] = 2.0f * rand() / RAND_MAX - 1.0f;
+  }
+}
+
+/*
+ *
+ * Write a random matrix file.  dims is given as <rows>x<cols>.
+ *
+ */
+void mat_generate(const char *dims, const char *path, int type)
+{
+  Matrix mat;
+  int rows, cols;
+
+  if (sscanf(dims, "%dx%d", &rows, &cols) != 2 || rows < 1 || cols < 1)
+  {
+    printf("[ERROR]: expected <rows>x<cols>, got %s\n", dims);
+    exit(EXIT_FAILURE);
+  }
+
+  mat_create(&mat, path, type, rows, cols);
+  mat_fill_random(&mat);
+  mat_close(&mat);
+}
+
+/*
+ *
+ * Write a random sparse matrix file in cfg.sparse_format, each element being nonzero
+ * with probability cfg.density.  The structure is drawn twice from the same seed, once
+ * to count the entries and once to fill them in.
+ *
+ */
+void mat_generate_sparse(const char *dims, const char *path, int type)
+{
+  const unsigned int threshold = (unsigned int) (cfg.density * RAND_MAX);
+  const int format = cfg.sparse_format == MAT_COO ? MAT_COO : MAT_CSR;
+  unsigned int seed = 1, vseed = 2;
+  Matrix mat;
+  int *row_idx;
+  int rows, cols, i, j;
+  size_t nnz = 0, p = 0;
+
+  if (sscanf(dims, "%dx%d", &rows, &cols) != 2 || rows < 1 || cols < 1)
+  {
+    printf("[ERROR]: expected <rows>x<cols>, got %s\n", dims);
+    exit(EXIT_FAILURE);
+  }
+
+  for (i=0; i<rows; i++)
+    for (j=0; j<cols; j++)
+      if ((unsigned int) rand_r(&seed) <= threshold)
+        nnz++;
+
+  mat_create_sparse(&mat, path, format, type, rows, cols, nnz);
+  row_idx = (int *) mat.row_ptr;
+
+  seed = 1;
+  for (i=0; i<rows; i++)
+  {
+    if (format == MAT_CSR)
+      mat.row_ptr[i] = p;
+
+    for (j=0; j<cols; j++)
+    {
+      if ((unsigned int) rand_r(&seed) > threshold)
+        continue;
+
+      if (format == MAT_COO)
+        row_idx[p] = i;
+      mat.col_idx[p] = j;
+      if (type == MAT_INT32)
+        MAT_I32(&mat)[p] = rand_r(&vseed) % 7 - 3;
+      else
+        MAT_F32(&mat)[p] = 2.0f * rand_r(&vseed) / RAND_MAX - 1.0f;
+      p++;
+    }
+  }
+
+  if (format == MAT_CSR)
+    mat.row_ptr[rows] = p;
+
+  mat_close(&mat);
+}
+
+/*
+ *
+ * Monotonic wall clock time in seconds.
+ *
+ */
+double now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ *
+ *  This function builds a sum of i products.  Take element i of row j from Matrix A,
+ *  and multiply it by element i of column k from Matrix B.  The result is stored in
+ *  the Element passed in, so no value is returned.
+ *
+ *  This is the reference implementation the worker pool is checked against.
+ *
+*/
+void *CalcProduct(void *param)
+{
+  Element *row_col = (Element *) param;
+  int i;
+
+  const int ROW = row_col->i;
+  const int COL = row_col->j;
+  const size_t a_row = (size_t) ROW * A.cols;
+  int64_t p;
+  long b_idx;
+
+  row_col->value = 0;
+  row_col->fvalue = 0;
+
+  // sparse operands: walk the nonzeros of row ROW of A and look up column COL of B.
+  if (A.format != MAT_DENSE)
+  {
+    for (p=A.row_ptr[ROW]; p<A.row_ptr[ROW+1]; p++)
+    {
+      if ((b_idx = mat_find(&B, A.col_idx[p], COL)) < 0)
+        continue;
+
+      if (A.type == MAT_FLOAT32)
+        row_col->fvalue += (MAT_F32(&A)[p] * MAT_F32(&B)[b_idx]);
+      else
+        row_col->value += (MAT_I32(&A)[p] * MAT_I32(&B)[b_idx]);
+    }
+
+    return NULL;
+  }
+
+  if (A.type == MAT_FLOAT32)
+  {
+    for (i=0; i<A.cols; i++)
+      row_col->fvalue += (MAT_F32(&A)[a_row + i] * MAT_F32(&B)[(size_t) i * B.cols + COL]);
+
+    return NULL;
+  }
 
-  for (i=0; i<K; i++)
-    C[ROW][COL] += (A[ROW][i] * B[i][COL]);
+  for (i=0; i<A.cols; i++)
+    row_col->value += (MAT_I32(&A)[a_row + i] * MAT_I32(&B)[(size_t) i * B.cols + COL]);
 
-  pthread_exit(NULL);
+  return NULL;
 }
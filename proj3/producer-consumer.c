@@ -3,30 +3,469 @@
  * producer-consumer.c
  * Tim Green
  * 3/23/14
- * version 1.0
+ * version 1.20
  *
  * Project 3, Part 2: Producer-Consumer
  *
- * producer-consumer.x <sleep time> <num producer threads> <num consumer threads>
+ * producer-consumer.x [-q mpmc|sem|spsc|pipe|shard] [-k] [-m <name>] [-s <slots>]
+ *                     [-b <batch> | -r <bytes>] [-v <level>] [--seed <seed>] <sleep time>
+ *                     <num producer threads> <num consumer threads>
+ * producer-consumer.x -B [-q mpmc|sem|spsc|pipe|shard] [-k] [-m <name>] [-s <slots>]
+ *                     [-b <batch> | -r <bytes>] [-n <items>] <seconds>
+ *                     <max producer threads> <max consumer threads>
+ * producer-consumer.x -P <threads>[:<work>],... [-A] [-s <slots>] <seconds>
+ *
+ * -q picks the queue behind insert_item and remove_item.  mpmc (the default) is a
+ * lock-free queue for any number of producers and consumers (see MpmcQueue), where
+ * threads only contend on the slot and counter they claim.  sem is the original
+ * bounded buffer guarded by two semaphores and one mutex.  spsc is a lock-free ring
+ * for exactly one producer and one consumer (see SpscRing), which moves an item with
+ * one release store and no read-modify-write at all.  pipe passes items through a
+ * kernel pipe, as a baseline for the others.
+ *
+ * shard gives every consumer an MPMC queue of its own (a shard of <slots> slots), so
+ * consumers do not contend with each other: consumer i owns shard i.  Producers spread
+ * items over the shards round-robin, and a consumer whose shard is empty steals a
+ * batch from the fullest shard before it waits (see shard_remove_items).  With -k
+ * they spread them by key (the item's value) instead, and consumers do not steal, so
+ * all items with one key are handled by the one consumer owning their shard, in the
+ * order they were inserted.
+ *
+ * -m puts the MPMC queue in the shared memory segment <name> (see mpmc_init), so that
+ * separate processes can exchange items through it: the first process to use the name
+ * creates the segment, and later ones attach to it and take its capacity and record
+ * size.  Every wait and wakeup in the queue is a futex on the shared memory itself, so
+ * nothing in it is private to one process.  One process may run only producers and
+ * another only consumers.
+ *
+ * -s sets the capacity of the queue (BUFFER_SIZE by default).  -r moves records of up
+ * to <bytes> bytes instead of single items, through the MPMC queue's slots (see
+ * record_reserve): a producer writes its record straight into a reserved slot and
+ * commits it, and a consumer reads it in place and releases the slot, so a record is
+ * never copied on its way through the queue.
+ *
+ * A thread that finds the queue full or empty waits adaptively (see wait_step): it
+ * spins briefly, then yields, and only then sleeps in the kernel on the very slot or
+ * index it waits for, so a handoff that takes microseconds costs no system call.  Each
+ * MPMC waiter waits for a position of its own, and a publish wakes just the one thread
+ * whose turn it gives, however many are idle.
+ *
+ * Each thread draws its random numbers from a generator of its own (see rng_next),
+ * seeded from --seed (1 by default) and the thread's number, so threads never share
+ * libc's locked rand() state and a run is reproducible from its seed.
+ *
+ * After <sleep time> seconds the producers stop, each after the item in hand, and
+ * the consumers drain what is left in the buffer: each takes a stop item that queues
+ * up behind the last real one (see stop_item).  Once every thread is joined and the
+ * queue destroyed, the program prints the items each thread moved, its throughput and
+ * how long it was blocked on a full buffer (a producer) or an empty one (a consumer),
+ * and the totals.
+ *
+ * Threads log through a buffer of their own (see log_msg), which a background thread
+ * empties to stdout with large writev calls, so logging an item costs a format and a
+ * copy rather than the stdio lock and a system call.  Lines of one thread stay in
+ * order, but lines of different threads can come out in any order.  -v sets how much
+ * is logged: 0 nothing, 1 errors, 2 (the default) every item as well.
+ *
+ * -b makes each producer generate bursts of <batch> items and each consumer take up to
+ * <batch> items at a time, through insert_items and remove_items.  The lock-free
+ * queues move a whole run of slots in one synchronization round-trip: a single
+ * compare-and-swap (mpmc and shard) or release store (spsc).  The sem queue only
+ * takes its mutex once per batch and still pays a semaphore operation per item.
+ *
+ * -P runs a pipeline instead (see run_pipeline): one stage per comma-separated entry,
+ * each with its own number of threads and <work> rounds of work per item, and a
+ * bounded MPMC buffer of <slots> slots between each stage and the next.  The first
+ * stage makes items and the last one folds them into a sum.  A full buffer holds
+ * back the stage before it, and so on upstream.  Every second one CSV row per stage
+ * gives its threads, throughput, input buffer occupancy, and the share of its
+ * threads' time stalled waiting for input or for room downstream, so the bottleneck
+ * is the stage that stalls least.  -A moves a thread a second from the stage that
+ * stalls most to the one that stalls least, or adds one to the latter when no stage
+ * that stalls much more has a thread to spare, while the pipeline has fewer threads
+ * than CPUs and the last thread added raised its throughput (see pipeline_rebalance).
+ * After <seconds> the stages stop one by one from the first, each after finishing
+ * what the one before it passed on (see stage_stop), and the program prints the
+ * items each stage handled and their sum.
+ *
+ * -B benchmarks the queue instead (see run_bench): producers and consumers run flat
+ * out without sleeping or printing, for 1, 2, 4, ... up to the given number of each,
+ * and one CSV row per run gives the throughput and the p50/p99/p99.9 latency from
+ * insert to remove.  Each run moves <items> items, or lasts <seconds> without -n.
+ * With -m or -q pipe the consumers of each run are a separate process.  make pcbench
+ * compares the queues into pcbench.csv.
  *
 */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
 #include <unistd.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
 #include <pthread.h>
 #include <semaphore.h>
 
 #include "buffer.h"
 
-buffer_item buffer[BUFFER_SIZE];
+// size of a cache line; indices written by different threads are kept this far apart
+// so that neither side's stores invalidate the other's reads.
+#define CACHE_LINE 64
+
+// queues behind insert_item and remove_item.
+#define QUEUE_SEM 0
+#define QUEUE_SPSC 1
+#define QUEUE_MPMC 2
+#define QUEUE_PIPE 3
+#define QUEUE_SHARD 4
+
+// set in a shared MPMC queue once its creator has initialized it, and how many times
+// (a millisecond apart) a process attaching to it checks before giving up.
+#define MPMC_MAGIC 0x4d504d43
+#define SHM_TRIES 5000
+
+// adaptive waiting: a thread spins (with pause) for up to its spin limit, which
+// starts at SPIN_START and moves between SPIN_MIN and SPIN_MAX with experience, then
+// yields YIELD_ROUNDS times, then sleeps on a futex.
+#define SPIN_MIN 16
+#define SPIN_START 256
+#define SPIN_MAX 8192
+#define YIELD_ROUNDS 4
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#else
+#define cpu_relax() __asm__ __volatile__("" ::: "memory")
+#endif
+
+// log levels for -v, the bytes of each thread's log buffer (a power of two), the
+// longest line logged, the most iovecs the log writer hands writev at once, and how
+// long it sleeps when there is nothing to write.
+#define LOG_ERROR 1
+#define LOG_ITEM 2
+#define LOG_BUF 65536
+#define LOG_LINE 256
+#define LOG_IOV 64
+#define LOG_IDLE_US 1000
+
+// most stages in a pipeline, the most threads in one (and in one stage), and the
+// items a stage thread handles between updates of its stage's counters.
+#define PIPE_STAGES 16
+#define PIPE_THREADS 64
+#define PIPE_FLUSH 64
+
+// benchmark latencies are kept in a log-linear histogram: values below HIST_SUB
+// nanoseconds exactly, larger ones in HIST_SUB buckets per power of two, so every
+// percentile is within 1/HIST_SUB of the truth.
+#define HIST_SUB 16
+#define HIST_SHIFT 4
+#define HIST_BUCKETS (32 * HIST_SUB)
+
+// benchmark item that tells a consumer to stop.  Real items carry the low 32 bits of
+// their insert time in nanoseconds, which never take this value (see bench_stamp).
+#define BENCH_STOP ((buffer_item) -1)
+
+// single-producer/single-consumer ring.  head counts items ever inserted and is only
+// written by the producer, tail counts items ever removed and is only written by the
+// consumer; slot i % capacity holds item i.  Each side keeps a private copy of the
+// other's index next to its own and rereads the shared one only when the ring looks
+// full (or empty) from that copy.  head_waiters counts a consumer asleep waiting for
+// head to move, tail_waiters a producer waiting for tail.
+typedef struct spsc_ring
+{
+  unsigned long head __attribute__((aligned(CACHE_LINE)));
+  unsigned int head_waiters;
+  unsigned long tail_cache;
+  unsigned long tail __attribute__((aligned(CACHE_LINE)));
+  unsigned int tail_waiters;
+  unsigned long head_cache;
+  buffer_item *items;
+} SpscRing;
+
+// one slot of the MPMC queue, padded to its own cache line.  seq says whose turn the
+// slot is: pos when it is free for the producer that claims position pos, pos + 1 once
+// that producer has stored its item, and pos + capacity when the consumer of pos has
+// emptied it for the next lap.  len is the length of a record in the slot's data, and
+// waiters the number of threads asleep waiting for seq to change.
+typedef struct mpmc_slot
+{
+  unsigned long seq;
+  unsigned int waiters;
+  buffer_item item;
+  int len;
+} __attribute__((aligned(CACHE_LINE))) MpmcSlot;
+
+// bounded multi-producer/multi-consumer queue.  Producers claim positions by advancing
+// head, consumers likewise with tail, and position pos lives in slot pos % capacity.
+// A blocking claim takes one position with a fetch-and-add and waits for its turn at
+// it; a run of slots that is already free (or full) is taken with a compare-and-swap.
+// A thread only waits when its slot is really still full (or still empty).  The queue
+// is a single block: this header, capacity slots, and in record mode record_stride
+// bytes per slot after them (see mq_data).  capacity and record_size tell a process
+// attaching to a shared queue its geometry, and magic says the block is ready.
+typedef struct mpmc_queue
+{
+  unsigned long head __attribute__((aligned(CACHE_LINE)));
+  unsigned long tail __attribute__((aligned(CACHE_LINE)));
+  unsigned int magic __attribute__((aligned(CACHE_LINE)));
+  int capacity;
+  int record_size;
+  MpmcSlot slots[];
+} MpmcQueue;
+
+// a record slot held between record_reserve and record_commit, or between record_read
+// and record_release.  data points at the slot's record_size bytes inside the queue
+// and len is the length of the committed record.
+typedef struct record
+{
+  unsigned long pos;
+  char *data;
+  int len;
+} Record;
+
+// one thread's log buffer, a byte ring with the same protocol as SpscRing: the thread
+// appends lines at head and the log writer writes them out and advances tail.  All
+// buffers are chained from log_bufs through next.
+typedef struct log_buf
+{
+  unsigned long head __attribute__((aligned(CACHE_LINE)));
+  unsigned long tail __attribute__((aligned(CACHE_LINE)));
+  unsigned int tail_waiters;
+  struct log_buf *next;
+  char data[LOG_BUF];
+} LogBuf;
+
+// one thread of a pipeline stage: its id, its stage, whether the slot holds a thread
+// that has not been joined, and whether that thread has left the stage.
+typedef struct stage_thread
+{
+  pthread_t tid;
+  struct stage *stage;
+  int used;
+  int left;
+} StageThread;
+
+// one stage of a pipeline.  Its threads take items from in (the first stage makes
+// them instead), apply cost rounds of work to each and put the result into out (the
+// last stage adds it to sum instead).  target is the number of threads the stage
+// should have and running the number it has; a thread beyond target leaves between
+// items.  items counts the items done, stall_in the seconds spent waiting for input
+// and stall_out for room downstream, spawned the threads ever started, and thread
+// the slots of the threads it has now.
+typedef struct stage
+{
+  int index;
+  int cost;
+  MpmcQueue *in;
+  MpmcQueue *out;
+  int target;
+  int running;
+  int spawned;
+  StageThread thread[PIPE_THREADS];
+  unsigned long items;
+  double stall_in;
+  double stall_out;
+  unsigned long sum;
+} Stage;
+
+// one producer or consumer thread: its number, its index among the producers or the
+// consumers (with -q shard, the first shard it inserts into or the one it owns), the
+// items it moved, and the seconds it spent blocked on a full buffer (a producer) or
+// an empty one (a consumer).
+typedef struct worker
+{
+  pthread_t tid;
+  int number;
+  int shard;
+  long items;
+  double blocked;
+} Worker;
+
+// one benchmark thread and its results.  shard is its index among the producers or
+// the consumers, as for Worker.  quota is the number of items a producer inserts, or 0
+// to insert until bench_done is set.
+typedef struct bench_thread
+{
+  pthread_t tid;
+  int shard;
+  long quota;
+  long items;
+  unsigned long hist[HIST_BUCKETS];
+} BenchThread;
+
+buffer_item *buffer;
+SpscRing ring;
+int pipe_fd[2];
+
+// the MPMC queue, the bytes of its block, and where its record data starts in this
+// process.
+MpmcQueue *mq;
+size_t mq_size;
+char *mq_data;
+
+// with -q shard, one MPMC queue per consumer, and whether -k routes items to them by
+// key.  shard_stops counts the stop items inserted, the k-th of which goes to shard
+// k % shards.  shard_home is the shard this thread owns, as a consumer, and shard_rr
+// the next it inserts into, as a producer; both come from the thread's own index.
+MpmcQueue **shard;
+int shards = 0;
+int shard_key = 0;
+int shard_stops = 0;
+__thread int shard_home = 0;
+__thread int shard_rr = 0;
+
+// name of the shared memory segment holding the MPMC queue, from -m, and whether this
+// process created it.  Futexes in a shared queue cannot be process-private.
+const char *shm_name = NULL;
+int shm_created = 0;
+int futex_private = FUTEX_PRIVATE_FLAG;
+
+// queue in use, set from -q, its capacity from -s, the producer burst and consumer
+// batch size from -b, and the largest record from -r (0 to move items).  Each record
+// slot takes record_size rounded up to whole cache lines.
+int queue = QUEUE_MPMC;
+int capacity = BUFFER_SIZE;
+int batch = 1;
+int record_size = 0;
+size_t record_stride;
+
+// log level from -v, every thread's log buffer, this thread's, the log writer thread,
+// and whether it should write what is left and stop.
+int log_level = LOG_ITEM;
+LogBuf *log_bufs = NULL;
+__thread LogBuf *log_buf = NULL;
+pthread_t log_tid;
+int log_stop = 0;
+
+// seed of every thread's random number generator, from --seed, and this thread's
+// generator state (see rng_next).
+unsigned long seed = 1;
+__thread uint64_t rng_state;
+
+// longest spin of any wait, 0 on a single CPU where spinning can only delay the thread
+// being waited for, and this thread's current spin limit.
+int spin_max = SPIN_MAX;
+__thread int spin_limit = SPIN_START;
+
+// seconds this thread has spent waiting in wait_step and sem_wait_adaptive, and when
+// its current wait started.
+__thread double wait_time = 0;
+__thread double wait_start;
+
+// the pipeline from -P, and whether -A rebalances its threads.  grown is the stage
+// the rebalancer last gave a new thread, while it waits to see whether the
+// pipeline's throughput rose from grown_from items/s; once one did not, growing stops.
+Stage stage[PIPE_STAGES];
+int stages = 0;
+int rebalance = 0;
+int grown = -1;
+double grown_from;
+int growing = 1;
+pthread_mutex_t stage_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 int insert_item(buffer_item item);
 int remove_item(buffer_item *item);
+int insert_items(const buffer_item *items, int count);
+int remove_items(buffer_item *items, int count);
+int spsc_insert(buffer_item item);
+int spsc_remove(buffer_item *item);
+int spsc_insert_items(const buffer_item *items, int count);
+int spsc_remove_items(buffer_item *items, int count);
+int mpmc_insert(MpmcQueue *q, buffer_item item);
+int mpmc_remove(MpmcQueue *q, buffer_item *item);
+unsigned long mpmc_claim(MpmcQueue *q, unsigned long *counter, unsigned long lap);
+int mpmc_insert_items(MpmcQueue *q, const buffer_item *items, int count);
+int mpmc_remove_items(MpmcQueue *q, buffer_item *items, int count);
+uint32_t mpmc_bit(unsigned long pos, unsigned long lap);
+int mpmc_try_insert_items(MpmcQueue *q, const buffer_item *items, int count);
+int record_reserve(Record *rec);
+int record_commit(const Record *rec, int len);
+int record_read(Record *rec);
+int record_release(const Record *rec);
+int pipe_insert_items(const buffer_item *items, int count);
+int pipe_remove_items(buffer_item *items, int count);
+void mpmc_init(void);
+void mpmc_format(MpmcQueue *q);
+int mpmc_try_remove_items(MpmcQueue *q, buffer_item *items, int count, int thief);
+int shard_insert_items(const buffer_item *items, int count);
+int shard_remove_items(buffer_item *items, int count);
+MpmcQueue *shard_fullest(MpmcQueue *own, int *backlog);
+size_t mpmc_size(void);
+MpmcQueue *mpmc_map(int fd, size_t size);
+void *aligned_alloc_or_die(size_t size);
+int wait_step(unsigned long *word, unsigned long old, unsigned int *waiters, uint32_t bits,
+              int *round);
+void wait_end(int round);
+void publish(unsigned long *word, unsigned long value, unsigned int *waiters,
+             uint32_t bits);
+int sem_wait_adaptive(sem_t *sem);
+uint32_t *futex_word(unsigned long *word);
+void rng_seed(unsigned long stream);
+uint32_t rng_next(void);
+void log_msg(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+LogBuf *log_register(void);
+void log_start(void);
+void log_finish(void);
+void *log_writer(void *param);
+long log_drain(void);
+int writev_all(int fd, struct iovec *iov, int count);
 void *producer(void *param);
 void *consumer(void *param);
+void nap(int seconds);
+void record_stop(buffer_item item);
+void print_stats(const Worker *worker, int producers, int consumers, double elapsed);
 void buffer_init(void);
+void buffer_destroy(void);
+
+int run_bench(int producers, int consumers, int seconds, long items);
+double bench_run(int producers, int consumers, int seconds, long items,
+                 unsigned long *hist, long *moved);
+void *bench_producer(void *param);
+void *bench_consumer(void *param);
+void bench_start(BenchThread *thread, int count, void *(*func)(void *));
+void bench_collect(BenchThread *thread, int count, unsigned long *hist, long *moved);
+int write_all(int fd, const void *data, size_t size);
+int read_all(int fd, void *data, size_t size);
+buffer_item bench_stamp(void);
+int hist_index(unsigned int ns);
+unsigned int hist_value(int index);
+unsigned int hist_percentile(const unsigned long *hist, double q);
+double now(void);
+
+int parse_pipeline(const char *spec);
+int run_pipeline(int seconds);
+void stage_resize(Stage *st, int threads);
+void stage_reap(Stage *st);
+void stage_stop(Stage *st);
+int stage_leave(Stage *st);
+void stage_count(Stage *st, unsigned long items, unsigned long sum, double in, double out);
+void *stage_worker(void *param);
+buffer_item stage_work(buffer_item item, int cost);
+void pipeline_rebalance(const double *stalled, double rate);
+
+// set when a benchmark run with no item count is over.
+volatile int bench_done;
+
+// set when the producers are to stop, and the item that stops a consumer.  Real items
+// are never negative; with -m the stop item is this process's negated pid, so that a
+// consumer in another process can tell it is not its own and hand it back.
+int stopping = 0;
+buffer_item stop_item = BENCH_STOP;
 
 pthread_mutex_t mutex;
 sem_t s_empty, s_full;
@@ -36,50 +475,228 @@ int in = 0, out = 0;
 
 int main(int argc, char** argv)
 {
-  int i;
+  int i, opt, bench = 0, pipeline = 0, usage = 0;
+  long items = 0;
+  Worker *worker;
+  double start;
+
+  // --seed has no short form.
+  const struct option long_opts[] = {
+    { "seed", required_argument, NULL, 'S' },
+    { NULL, 0, NULL, 0 }
+  };
+
+  while ((opt = getopt_long(argc, argv, "q:km:s:b:r:n:v:P:AB", long_opts, NULL)) != -1)
+  {
+    switch (opt)
+    {
+      case 'S':
+        seed = strtoul(optarg, NULL, 0);
+        break;
+      case 'q':
+        if (strcmp(optarg, "mpmc") == 0)
+          queue = QUEUE_MPMC;
+        else if (strcmp(optarg, "sem") == 0)
+          queue = QUEUE_SEM;
+        else if (strcmp(optarg, "spsc") == 0)
+          queue = QUEUE_SPSC;
+        else if (strcmp(optarg, "pipe") == 0)
+          queue = QUEUE_PIPE;
+        else if (strcmp(optarg, "shard") == 0)
+          queue = QUEUE_SHARD;
+        else
+          usage = 1;
+        break;
+      case 'k':
+        shard_key = 1;
+        break;
+      case 'm':
+        shm_name = optarg;
+        break;
+      case 's':
+        capacity = atoi(optarg);
+        break;
+      case 'b':
+        batch = atoi(optarg);
+        break;
+      case 'r':
+        record_size = atoi(optarg);
+        break;
+      case 'n':
+        items = atol(optarg);
+        break;
+      case 'v':
+        log_level = atoi(optarg);
+        break;
+      case 'B':
+        bench = 1;
+        break;
+      case 'P':
+        pipeline = 1;
+        if (parse_pipeline(optarg))
+          usage = 1;
+        break;
+      case 'A':
+        rebalance = 1;
+        break;
+      default:
+        usage = 1;
+        break;
+    }
+  }
 
   // program only functions correctly with 3 arguments, print some help if misused
-  if (argc < 4)
+  if (usage || capacity < 1 || batch < 1 || record_size < 0 ||
+      argc - optind < (pipeline ? 1 : 3))
   {
     printf("\nHelp:\n");
-    printf("producer-consumer.x <sleep time> <num producer threads> <num consumer threads>\n\n");
+    printf("producer-consumer.x [-q mpmc|sem|spsc|pipe|shard] [-k] [-m <name>] "
+           "[-s <slots>] [-b <batch> | -r <bytes>] [-v <level>] [--seed <seed>] "
+           "<sleep time> <num producer threads> <num consumer threads>\n");
+    printf("producer-consumer.x -B [-q mpmc|sem|spsc|pipe|shard] [-k] [-m <name>] "
+           "[-s <slots>] [-b <batch> | -r <bytes>] [-n <items>] <seconds> "
+           "<max producer threads> <max consumer threads>\n");
+    printf("producer-consumer.x -P <threads>[:<work>],... [-A] [-s <slots>] "
+           "<seconds>\n\n");
     exit(0);
   }
 
-  // convert string arguments to integers for later use
-  const int SLEEP = atoi(argv[1]);
-  const int PRODUCER = atoi(argv[2]);
-  const int CONSUMER = atoi(argv[3]);
+  // records live in the MPMC queue's slots, one at a time, and the smallest record
+  // still has room for a benchmark stamp.
+  if (record_size > 0 && (queue != QUEUE_MPMC || batch != 1 ||
+                          record_size < (int) sizeof(buffer_item)))
+  {
+    printf("[ERROR]: -r needs -q mpmc, no -b, and at least %d bytes\n",
+           (int) sizeof(buffer_item));
+    exit(EXIT_FAILURE);
+  }
+  record_stride = (record_size + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+
+  // with one slot, an MPMC slot published for this lap (seq pos + 1) would look free
+  // for the next (pos + capacity).  Shards are MPMC queues too.
+  if ((queue == QUEUE_MPMC || queue == QUEUE_SHARD) && capacity < 2)
+  {
+    printf("[ERROR]: -q mpmc and -q shard need at least 2 slots\n");
+    exit(EXIT_FAILURE);
+  }
 
-  // create PRODUCER*CONSUMER threads
-  pthread_t p_tid[PRODUCER];
-  pthread_t c_tid[CONSUMER];
+  if (shard_key && queue != QUEUE_SHARD)
+  {
+    printf("[ERROR]: -k needs -q shard\n");
+    exit(EXIT_FAILURE);
+  }
 
-  for (i=0; i<PRODUCER; i++)
+  // only the MPMC queue keeps all of its state in one block that can be shared.
+  if (shm_name != NULL)
   {
-    int rc = pthread_create(&p_tid[i], NULL, producer, NULL);
-    if (rc) 
+    if (queue != QUEUE_MPMC)
     {
-      perror("[ERROR]");
+      printf("[ERROR]: -m needs -q mpmc\n");
       exit(EXIT_FAILURE);
     }
+    futex_private = 0;
+    stop_item = -(buffer_item) getpid();
   }
 
-  for (i=0; i<CONSUMER; i++)
+  if (sysconf(_SC_NPROCESSORS_ONLN) < 2)
+    spin_max = 0;
+
+  // a pipeline's buffers are MPMC queues, whatever -q says.
+  if (pipeline)
   {
-    int rc = pthread_create(&c_tid[i], NULL, consumer, NULL);
-    if (rc) 
+    if (bench || shm_name != NULL || record_size > 0 || capacity < 2)
     {
-      perror("[ERROR]");
+      printf("[ERROR]: -P cannot be combined with -B, -m or -r, and needs 2 slots\n");
       exit(EXIT_FAILURE);
     }
+    return run_pipeline(atoi(argv[optind]));
+  }
+
+  // convert string arguments to integers for later use
+  const int SLEEP = atoi(argv[optind]);
+  const int PRODUCER = atoi(argv[optind + 1]);
+  const int CONSUMER = atoi(argv[optind + 2]);
+
+  if (bench)
+    return run_bench(PRODUCER, CONSUMER, SLEEP, items);
+
+  // the ring's indices each have a single writer.
+  if (queue == QUEUE_SPSC && (PRODUCER != 1 || CONSUMER != 1))
+  {
+    printf("[ERROR]: -q spsc needs exactly one producer and one consumer\n");
+    exit(EXIT_FAILURE);
   }
 
-  // create semaphores and mutex, initializing the semaphores according to BUFFER_SIZE
+  // every shard has a consumer of its own.
+  shards = CONSUMER;
+  if (queue == QUEUE_SHARD && shards < 1)
+  {
+    printf("[ERROR]: -q shard needs at least one consumer\n");
+    exit(EXIT_FAILURE);
+  }
+
+  // items only leave through consumers; without any (here or, with -m, in another
+  // process) the producers would fill the buffer and never stop.
+  if (PRODUCER > 0 && CONSUMER < 1 && shm_name == NULL)
+  {
+    printf("[ERROR]: producers need at least one consumer\n");
+    exit(EXIT_FAILURE);
+  }
+
+  // create PRODUCER+CONSUMER threads
+  worker = calloc(PRODUCER + CONSUMER + 1, sizeof(Worker));
+  if (worker == NULL)
+  {
+    perror("[ERROR]");
+    exit(EXIT_FAILURE);
+  }
+
+  // create semaphores and mutex, initializing the semaphores according to capacity.
+  // This must happen before any thread can touch the buffer, and the log writer must
+  // run before any thread logs.
   buffer_init();
+  log_start();
+
+  start = now();
+  for (i=0; i<PRODUCER + CONSUMER; i++)
+  {
+    worker[i].number = i;
+    worker[i].shard = i < PRODUCER ? i : i - PRODUCER;
+    int rc = pthread_create(&worker[i].tid, NULL, i < PRODUCER ? producer : consumer,
+                            &worker[i]);
+    if (rc) 
+    {
+      perror("[ERROR]");
+      exit(EXIT_FAILURE);
+    }
+  }
 
-  // exit the main program after SLEEP seconds
+  // after SLEEP seconds, stop the producers, then queue one stop item per consumer
+  // behind the last real item so that the consumers drain the buffer before leaving.
   sleep(SLEEP);
+  __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+
+  for (i=0; i<PRODUCER; i++)
+    pthread_join(worker[i].tid, NULL);
+
+  for (i=0; i<CONSUMER; i++)
+  {
+    if (record_size > 0)
+      record_stop(stop_item);
+    else if (insert_item(stop_item))
+      printf("[ERROR]: failure in critical section of main thread!\n");
+  }
+
+  for (i=PRODUCER; i<PRODUCER + CONSUMER; i++)
+    pthread_join(worker[i].tid, NULL);
+
+  // everything logged comes out before the statistics.  A shared segment's name goes
+  // with its creator; processes still attached keep their mapping.
+  log_finish();
+  print_stats(worker, PRODUCER, CONSUMER, now() - start);
+
+  buffer_destroy();
+  free(worker);
 
   return 0;
 }
@@ -91,15 +708,242 @@ int main(int argc, char** argv)
  */
 void buffer_init(void)
 {
+  int i;
+
+  // the queues start empty, also when a benchmark reuses them.  A shared MPMC queue
+  // may set capacity, so it comes first.
+  mpmc_init();
+  in = out = 0;
+  memset(&ring, 0, sizeof(ring));
+
+  if (queue == QUEUE_SHARD)
+  {
+    shard = calloc(shards, sizeof(MpmcQueue *));
+    if (shard == NULL)
+    {
+      perror("[ERROR]");
+      exit(EXIT_FAILURE);
+    }
+    for (i=0; i<shards; i++)
+    {
+      shard[i] = aligned_alloc_or_die(mpmc_size());
+      memset(shard[i], 0, mpmc_size());
+      mpmc_format(shard[i]);
+    }
+    shard_stops = 0;
+  }
+
+  buffer = aligned_alloc_or_die(capacity * sizeof(buffer_item));
+  ring.items = aligned_alloc_or_die(capacity * sizeof(buffer_item));
+
+  // the pipe holds at least a page, however small capacity is.
+  if (queue == QUEUE_PIPE)
+  {
+    if (pipe(pipe_fd))
+    {
+      perror("[ERROR]");
+      exit(EXIT_FAILURE);
+    }
+    fcntl(pipe_fd[1], F_SETPIPE_SZ, capacity * (int) sizeof(buffer_item));
+  }
+
   // create mutex with default attributes (second parameter)
   pthread_mutex_init(&mutex, NULL);
 
   // create semaphores and initialize (zero full, max empty).  second param ensures that only 
   // threads belonging to this process can share the semaphore data.
-  sem_init(&s_empty, 0, BUFFER_SIZE);
+  sem_init(&s_empty, 0, capacity);
   sem_init(&s_full, 0, 0);
 }
 
+/*
+ *
+ * Set up the MPMC queue: on the heap, or with -m in the shared memory segment
+ * shm_name.  The first process to open the segment creates it and initializes the
+ * queue; a process that finds it already there waits until the creator has set magic
+ * and then takes capacity and record_size from it.
+ *
+ */
+void mpmc_init(void)
+{
+  struct stat st;
+  int fd, tries;
+
+  if (shm_name == NULL)
+  {
+    mq_size = mpmc_size();
+    mq = aligned_alloc_or_die(mq_size);
+    memset(mq, 0, mq_size);
+  }
+  else
+  {
+    fd = shm_open(shm_name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    shm_created = fd >= 0;
+    if (!shm_created && errno == EEXIST)
+      fd = shm_open(shm_name, O_RDWR, 0);
+    if (fd < 0)
+    {
+      perror("[ERROR]");
+      exit(EXIT_FAILURE);
+    }
+
+    if (shm_created)
+    {
+      // a new segment is all zeroes.
+      mq_size = mpmc_size();
+      if (ftruncate(fd, mq_size))
+      {
+        perror("[ERROR]");
+        exit(EXIT_FAILURE);
+      }
+      mq = mpmc_map(fd, mq_size);
+    }
+    else
+    {
+      // the creator may not have sized the segment, or filled it in, yet.
+      for (tries=0; ; tries++)
+      {
+        if (fstat(fd, &st))
+        {
+          perror("[ERROR]");
+          exit(EXIT_FAILURE);
+        }
+        if (st.st_size >= (off_t) sizeof(MpmcQueue))
+        {
+          mq = mpmc_map(fd, sizeof(MpmcQueue));
+          if (__atomic_load_n(&mq->magic, __ATOMIC_ACQUIRE) == MPMC_MAGIC)
+            break;
+          munmap(mq, sizeof(MpmcQueue));
+        }
+        if (tries == SHM_TRIES)
+        {
+          printf("[ERROR]: shared memory segment %s is not a queue\n", shm_name);
+          exit(EXIT_FAILURE);
+        }
+        usleep(1000);
+      }
+
+      capacity = mq->capacity;
+      record_size = mq->record_size;
+      record_stride = (record_size + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+      munmap(mq, sizeof(MpmcQueue));
+
+      mq_size = mpmc_size();
+      mq = mpmc_map(fd, mq_size);
+    }
+
+    close(fd);
+  }
+
+  mq_data = (char *) (mq->slots + capacity);
+  if (shm_created || shm_name == NULL)
+    mpmc_format(mq);
+}
+
+/*
+ *
+ * Initialize the zeroed block of MPMC queue q for the current capacity and record
+ * size, every slot free for its first lap, and mark it ready.
+ *
+ */
+void mpmc_format(MpmcQueue *q)
+{
+  int i;
+
+  q->capacity = capacity;
+  q->record_size = record_size;
+  for (i=0; i<capacity; i++)
+    q->slots[i].seq = i;
+
+  __atomic_store_n(&q->magic, MPMC_MAGIC, __ATOMIC_RELEASE);
+}
+
+/*
+ *
+ * Bytes in the MPMC queue's block for the current capacity and record size.
+ *
+ */
+size_t mpmc_size(void)
+{
+  return sizeof(MpmcQueue) + capacity * (sizeof(MpmcSlot) + record_stride);
+}
+
+/*
+ *
+ * Map the first size bytes of the shared memory segment fd.
+ *
+ */
+MpmcQueue *mpmc_map(int fd, size_t size)
+{
+  void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+  if (p == MAP_FAILED)
+  {
+    perror("[ERROR]");
+    exit(EXIT_FAILURE);
+  }
+
+  return p;
+}
+
+/*
+ *
+ * Destroy the mutex and semaphores created by buffer_init.
+ *
+ */
+void buffer_destroy(void)
+{
+  int i;
+
+  pthread_mutex_destroy(&mutex);
+  sem_destroy(&s_empty);
+  sem_destroy(&s_full);
+
+  free(buffer);
+  free(ring.items);
+
+  if (shm_name == NULL)
+    free(mq);
+  else
+  {
+    munmap(mq, mq_size);
+    if (shm_created)
+      shm_unlink(shm_name);
+  }
+
+  if (queue == QUEUE_PIPE)
+  {
+    close(pipe_fd[0]);
+    close(pipe_fd[1]);
+  }
+
+  if (queue == QUEUE_SHARD)
+  {
+    for (i=0; i<shards; i++)
+      free(shard[i]);
+    free(shard);
+  }
+}
+
+/*
+ *
+ * Allocate size bytes starting on a cache line, so that padded slots really sit on
+ * lines of their own.  Running out of memory is fatal.
+ *
+ */
+void *aligned_alloc_or_die(size_t size)
+{
+  void *p;
+
+  if (posix_memalign(&p, CACHE_LINE, size ? size : CACHE_LINE))
+  {
+    perror("[ERROR]");
+    exit(EXIT_FAILURE);
+  }
+
+  return p;
+}
+
 /*
  *
  * Thread-safe implementation of bounded buffer insert:
@@ -110,7 +954,16 @@ int insert_item(buffer_item item)
 {
   int retval = 0;
 
-  retval = sem_wait(&s_empty);
+  if (queue == QUEUE_SPSC)
+    return spsc_insert(item);
+  if (queue == QUEUE_MPMC)
+    return mpmc_insert(mq, item);
+  if (queue == QUEUE_PIPE)
+    return pipe_insert_items(&item, 1) == 1 ? 0 : -1;
+  if (queue == QUEUE_SHARD)
+    return shard_insert_items(&item, 1) == 1 ? 0 : -1;
+
+  retval = sem_wait_adaptive(&s_empty);
   if (retval)
     return retval;
 
@@ -119,7 +972,7 @@ int insert_item(buffer_item item)
     return retval;
 
   buffer[in] = item;
-  in = (in + 1) % BUFFER_SIZE;
+  in = (in + 1) % capacity;
 
   retval = sem_post(&s_full);
   if (retval)
@@ -142,7 +995,16 @@ int remove_item(buffer_item *item)
 {
   int retval = 0;
 
-  retval = sem_wait(&s_full);
+  if (queue == QUEUE_SPSC)
+    return spsc_remove(item);
+  if (queue == QUEUE_MPMC)
+    return mpmc_remove(mq, item);
+  if (queue == QUEUE_PIPE)
+    return pipe_remove_items(item, 1) == 1 ? 0 : -1;
+  if (queue == QUEUE_SHARD)
+    return shard_remove_items(item, 1) == 1 ? 0 : -1;
+
+  retval = sem_wait_adaptive(&s_full);
   if (retval)
     return retval;
 
@@ -151,7 +1013,7 @@ int remove_item(buffer_item *item)
     return retval;
 
   *item = buffer[out];
-  out = (out + 1) % BUFFER_SIZE;
+  out = (out + 1) % capacity;
   
   retval = sem_post(&s_empty);
   if (retval)
@@ -166,47 +1028,2058 @@ int remove_item(buffer_item *item)
 
 /*
  *
- * Threaded producer function:
- * Loops until the main program exits, producing random numbers for buffer.
+ * Thread-safe bulk insert: wait until at least one slot is empty, then insert as many
+ * of the count items as there are empty slots right now, under a single lock.  Only
+ * the lock is amortized: a POSIX semaphore moves by one, so each slot still costs a
+ * sem_trywait on s_empty and a sem_post on s_full.  The lock-free queues claim the
+ * whole run at once.  Returns the number of items inserted (the first that many of
+ * items), or -1 on failure.
  *
  */
-void *producer(void *param)
+int insert_items(const buffer_item *items, int count)
 {
-  int my_rand;
-  
-  // quiet the warnings for unused param argument
-  (void) param;
+  int i, n;
 
-  while (1)
+  if (count < 1)
+    return -1;
+
+  if (queue == QUEUE_SPSC)
+    return spsc_insert_items(items, count);
+  if (queue == QUEUE_MPMC)
+    return mpmc_insert_items(mq, items, count);
+  if (queue == QUEUE_PIPE)
+    return pipe_insert_items(items, count);
+  if (queue == QUEUE_SHARD)
+    return shard_insert_items(items, count);
+
+  // only the first slot is waited for; the rest are taken only if already free.
+  if (sem_wait_adaptive(&s_empty))
+    return -1;
+  for (n=1; n<count && sem_trywait(&s_empty) == 0; n++)
+    ;
+
+  if (pthread_mutex_lock(&mutex))
+    return -1;
+
+  for (i=0; i<n; i++)
   {
-    sleep(rand() % 5 + 1);
-    my_rand = rand() % RAND_MAX;
-    if (insert_item(my_rand))
-      printf("[ERROR]: failure in critical section of producer thread!\n");
-    else
-      printf("Producer produced %d\n", my_rand);
+    buffer[in] = items[i];
+    in = (in + 1) % capacity;
   }
+
+  if (pthread_mutex_unlock(&mutex))
+    return -1;
+
+  for (i=0; i<n; i++)
+    if (sem_post(&s_full))
+      return -1;
+
+  return n;
 }
 
 /*
  *
- * Threaded consumer function:
- * Loops until the main program exits, consuming random numbers from buffer.
+ * Thread-safe bulk remove, the mirror image of insert_items: wait for one item, then
+ * remove up to count of the items present under a single lock, with the same
+ * per-item semaphore cost.  Returns the number removed into items, or -1 on failure.
  *
  */
-void *consumer(void *param)
+int remove_items(buffer_item *items, int count)
 {
-  int remove_rand;
+  int i, n;
 
-  // quiet the warnings for unused param argument
-  (void) param;
+  if (count < 1)
+    return -1;
 
-  while (1)
+  if (queue == QUEUE_SPSC)
+    return spsc_remove_items(items, count);
+  if (queue == QUEUE_MPMC)
+    return mpmc_remove_items(mq, items, count);
+  if (queue == QUEUE_PIPE)
+    return pipe_remove_items(items, count);
+  if (queue == QUEUE_SHARD)
+    return shard_remove_items(items, count);
+
+  if (sem_wait_adaptive(&s_full))
+    return -1;
+  for (n=1; n<count && sem_trywait(&s_full) == 0; n++)
+    ;
+
+  if (pthread_mutex_lock(&mutex))
+    return -1;
+
+  for (i=0; i<n; i++)
   {
-    sleep(rand() % 5 + 1);
-    if (remove_item(&remove_rand))
-      printf("[ERROR]: failure in critical section of consumer thread!\n");
-    else
-      printf("Consumer consumed %d\n", remove_rand);
+    items[i] = buffer[out];
+    out = (out + 1) % capacity;
+  }
+
+  if (pthread_mutex_unlock(&mutex))
+    return -1;
+
+  for (i=0; i<n; i++)
+    if (sem_post(&s_empty))
+      return -1;
+
+  return n;
+}
+
+/*
+ *
+ * Lock-free insert for the single producer of the SPSC ring.  The item is written to
+ * its slot before the release store of head publishes it, so the consumer's acquire
+ * load of head also sees the item.  Waits while the ring is full.
+ *
+ */
+int spsc_insert(buffer_item item)
+{
+  const unsigned long head = ring.head;
+  int round = 0;
+
+  while (head - ring.tail_cache == (unsigned long) capacity)
+  {
+    ring.tail_cache = __atomic_load_n(&ring.tail, __ATOMIC_ACQUIRE);
+    if (head - ring.tail_cache == (unsigned long) capacity)
+      wait_step(&ring.tail, ring.tail_cache, &ring.tail_waiters, FUTEX_BITSET_MATCH_ANY,
+                &round);
+  }
+  wait_end(round);
+
+  ring.items[head % capacity] = item;
+  publish(&ring.head, head + 1, &ring.head_waiters, FUTEX_BITSET_MATCH_ANY);
+
+  return 0;
+}
+
+/*
+ *
+ * Lock-free remove for the single consumer of the SPSC ring, the mirror image of
+ * spsc_insert: the release store of tail hands the slot back to the producer only
+ * after the item has been read out of it.  Waits while the ring is empty.
+ *
+ */
+int spsc_remove(buffer_item *item)
+{
+  const unsigned long tail = ring.tail;
+  int round = 0;
+
+  while (tail == ring.head_cache)
+  {
+    ring.head_cache = __atomic_load_n(&ring.head, __ATOMIC_ACQUIRE);
+    if (tail == ring.head_cache)
+      wait_step(&ring.head, ring.head_cache, &ring.head_waiters, FUTEX_BITSET_MATCH_ANY,
+                &round);
+  }
+  wait_end(round);
+
+  *item = ring.items[tail % capacity];
+  publish(&ring.tail, tail + 1, &ring.tail_waiters, FUTEX_BITSET_MATCH_ANY);
+
+  return 0;
+}
+
+/*
+ *
+ * Bulk insert for the single producer of the SPSC ring: fill every free slot up to
+ * count and publish them all with one release store of head.
+ *
+ */
+int spsc_insert_items(const buffer_item *items, int count)
+{
+  const unsigned long head = ring.head;
+  int i, n, round = 0;
+
+  // the cached tail may be stale; refresh it once if it would shorten the batch.
+  if (capacity - (head - ring.tail_cache) < (unsigned long) count)
+    ring.tail_cache = __atomic_load_n(&ring.tail, __ATOMIC_ACQUIRE);
+
+  while (head - ring.tail_cache == (unsigned long) capacity)
+  {
+    wait_step(&ring.tail, ring.tail_cache, &ring.tail_waiters, FUTEX_BITSET_MATCH_ANY,
+              &round);
+    ring.tail_cache = __atomic_load_n(&ring.tail, __ATOMIC_ACQUIRE);
+  }
+  wait_end(round);
+
+  n = capacity - (int) (head - ring.tail_cache);
+  if (n > count)
+    n = count;
+
+  for (i=0; i<n; i++)
+    ring.items[(head + i) % capacity] = items[i];
+  publish(&ring.head, head + n, &ring.head_waiters, FUTEX_BITSET_MATCH_ANY);
+
+  return n;
+}
+
+/*
+ *
+ * Bulk remove for the single consumer of the SPSC ring: take every published item up
+ * to count and free their slots with one release store of tail.
+ *
+ */
+int spsc_remove_items(buffer_item *items, int count)
+{
+  const unsigned long tail = ring.tail;
+  int i, n, round = 0;
+
+  if (ring.head_cache - tail < (unsigned long) count)
+    ring.head_cache = __atomic_load_n(&ring.head, __ATOMIC_ACQUIRE);
+
+  while (tail == ring.head_cache)
+  {
+    wait_step(&ring.head, ring.head_cache, &ring.head_waiters, FUTEX_BITSET_MATCH_ANY,
+              &round);
+    ring.head_cache = __atomic_load_n(&ring.head, __ATOMIC_ACQUIRE);
+  }
+  wait_end(round);
+
+  n = (int) (ring.head_cache - tail);
+  if (n > count)
+    n = count;
+
+  for (i=0; i<n; i++)
+    items[i] = ring.items[(tail + i) % capacity];
+  publish(&ring.tail, tail + n, &ring.tail_waiters, FUTEX_BITSET_MATCH_ANY);
+
+  return n;
+}
+
+/*
+ *
+ * Lock-free insert into MPMC queue q: claim position head (see mpmc_claim), store
+ * the item, and publish it by setting the slot's seq to pos + 1 with a release store.
+ *
+ */
+int mpmc_insert(MpmcQueue *q, buffer_item item)
+{
+  const unsigned long pos = mpmc_claim(q, &q->head, 0);
+  MpmcSlot *slot = &q->slots[pos % capacity];
+
+  slot->item = item;
+  publish(&slot->seq, pos + 1, &slot->waiters, mpmc_bit(pos, 1));
+
+  return 0;
+}
+
+/*
+ *
+ * Lock-free remove from MPMC queue q, the mirror image of mpmc_insert: claim
+ * position tail, wait for its item to be published, read it, and free the slot for
+ * the next lap by setting seq to pos + capacity.
+ *
+ */
+int mpmc_remove(MpmcQueue *q, buffer_item *item)
+{
+  const unsigned long pos = mpmc_claim(q, &q->tail, 1);
+  MpmcSlot *slot = &q->slots[pos % capacity];
+
+  *item = slot->item;
+  publish(&slot->seq, pos + capacity, &slot->waiters, mpmc_bit(pos + capacity, 0));
+
+  return 0;
+}
+
+/*
+ *
+ * Claim the next position of counter of queue q (q->head for producers, q->tail for
+ * consumers) and return it once it is this thread's turn.  The position is taken
+ * with a fetch-and-add, so no two threads ever want the same one, and the turn comes
+ * when the slot's seq is pos + lap, which is 0 for a producer (the slot is free for
+ * this lap) and 1 for a consumer (this lap's item is published).  Until then the
+ * queue is full (or empty) and the thread waits on the slot, with the bit of its
+ * turn (see mpmc_bit), so the publish that gives it its turn wakes it and nobody
+ * else.
+ *
+ */
+unsigned long mpmc_claim(MpmcQueue *q, unsigned long *counter,
+                         unsigned long lap)
+{
+  const unsigned long pos = __atomic_fetch_add(counter, 1, __ATOMIC_RELAXED);
+  MpmcSlot *slot = &q->slots[pos % capacity];
+  const uint32_t bit = mpmc_bit(pos, lap);
+  unsigned long seq;
+  int round = 0, woken = 0;
+
+  while ((seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE)) != pos + lap)
+  {
+    // a turn mpmc_bit cannot tell from ours (one a multiple of 16 laps away) woke us
+    // instead of its thread; pass the wakeup on.
+    if (woken)
+      syscall(SYS_futex, futex_word(&slot->seq), FUTEX_WAKE_BITSET | futex_private, 1,
+              NULL, NULL, bit);
+    woken = wait_step(&slot->seq, seq, &slot->waiters, bit, &round);
+  }
+  wait_end(round);
+
+  return pos;
+}
+
+/*
+ *
+ * The futex bit a thread waits with for its turn at position pos of an MPMC queue, as
+ * a producer (lap 0) or a consumer (lap 1).  Producers and consumers of several laps
+ * can wait on one slot, and each publish wakes only the thread whose turn it gives;
+ * turns a multiple of 16 laps apart share a bit.
+ *
+ */
+uint32_t mpmc_bit(unsigned long pos, unsigned long lap)
+{
+  return 1u << ((pos / capacity * 2 + lap) % 32);
+}
+
+/*
+ *
+ * Bulk insert into MPMC queue q.  Takes the free run of slots at head if there is one
+ * (see mpmc_try_insert_items); only when the queue is full does the producer claim a
+ * single position and wait for it as mpmc_insert does, and then it adds whatever run
+ * has come free meanwhile.  Returns the number of items inserted.
+ *
+ */
+int mpmc_insert_items(MpmcQueue *q, const buffer_item *items, int count)
+{
+  int n = mpmc_try_insert_items(q, items, count);
+
+  if (n > 0)
+    return n;
+
+  mpmc_insert(q, items[0]);
+  if (count > 1)
+    n = mpmc_try_insert_items(q, items + 1, count - 1);
+
+  return n + 1;
+}
+
+/*
+ *
+ * Bulk remove from MPMC queue q, the mirror image of mpmc_insert_items: the run of
+ * published items at tail if there is one, otherwise a single item waited for as
+ * mpmc_remove does and whatever run has been published behind it.  Returns the number
+ * of items removed.
+ *
+ */
+int mpmc_remove_items(MpmcQueue *q, buffer_item *items, int count)
+{
+  int n = mpmc_try_remove_items(q, items, count, 0);
+
+  if (n > 0)
+    return n;
+
+  mpmc_remove(q, &items[0]);
+  if (count > 1)
+    n = mpmc_try_remove_items(q, items + 1, count - 1, 0);
+
+  return n + 1;
+}
+
+/*
+ *
+ * Insert up to count items into MPMC queue q without waiting: 0 if it is full.  The
+ * producer counts how many consecutive slots from head are free for this lap, claims
+ * all of them with a single compare-and-swap, and then fills and publishes each slot
+ * as mpmc_insert does, so consumers can take the first items of the run while the
+ * rest are still being written.  Returns the number of items inserted.
+ *
+ */
+int mpmc_try_insert_items(MpmcQueue *q, const buffer_item *items, int count)
+{
+  unsigned long pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+  MpmcSlot *slot;
+  int i, n;
+
+  do
+  {
+    for (n=0; n<count; n++)
+    {
+      slot = &q->slots[(pos + n) % capacity];
+      if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos + n)
+        break;
+    }
+
+    if (n == 0)
+      return 0;
+  }
+  while (!__atomic_compare_exchange_n(&q->head, &pos, pos + n, 1, __ATOMIC_RELAXED,
+                                      __ATOMIC_RELAXED));
+
+  for (i=0; i<n; i++)
+  {
+    slot = &q->slots[(pos + i) % capacity];
+    slot->item = items[i];
+    publish(&slot->seq, pos + i + 1, &slot->waiters, mpmc_bit(pos + i, 1));
+  }
+
+  return n;
+}
+
+/*
+ *
+ * Remove up to count published items from MPMC queue q without waiting: 0 if it is
+ * empty.  A thief (a consumer stealing from another's shard) stops short of a
+ * BENCH_STOP, which is meant for the shard's owner; the item of a slot can be
+ * checked before claiming it because nobody can reuse the slot until it is claimed.
+ * Returns the number of items removed.
+ *
+ */
+int mpmc_try_remove_items(MpmcQueue *q, buffer_item *items, int count, int thief)
+{
+  unsigned long pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+  MpmcSlot *slot;
+  int i, n;
+
+  do
+  {
+    for (n=0; n<count; n++)
+    {
+      slot = &q->slots[(pos + n) % capacity];
+      if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos + n + 1)
+        break;
+      if (thief && __atomic_load_n(&slot->item, __ATOMIC_RELAXED) == BENCH_STOP)
+        break;
+    }
+
+    if (n == 0)
+      return 0;
+  }
+  while (!__atomic_compare_exchange_n(&q->tail, &pos, pos + n, 1, __ATOMIC_RELAXED,
+                                      __ATOMIC_RELAXED));
+
+  for (i=0; i<n; i++)
+  {
+    slot = &q->slots[(pos + i) % capacity];
+    items[i] = slot->item;
+    publish(&slot->seq, pos + i + capacity, &slot->waiters,
+            mpmc_bit(pos + i + capacity, 0));
+  }
+
+  return n;
+}
+
+/*
+ *
+ * Sharded insert: put up to count items into one shard, which is the next in this
+ * producer's round-robin or, with -k, the shard of the first item's key.  A keyed
+ * call inserts only the leading items that share that shard.  A stop item goes alone,
+ * to the shard after the last one's (see shard_stops), so that however many threads
+ * insert them, one stop per consumer gives every shard's owner exactly one.  Returns
+ * the number of items inserted.
+ *
+ */
+int shard_insert_items(const buffer_item *items, int count)
+{
+  int i, n = count;
+
+  if (items[0] == BENCH_STOP)
+  {
+    i = __atomic_fetch_add(&shard_stops, 1, __ATOMIC_RELAXED) % shards;
+    n = 1;
+  }
+  else if (shard_key)
+  {
+    i = (unsigned int) items[0] % shards;
+    for (n=1; n<count && (unsigned int) items[n] % shards == (unsigned int) i; n++)
+      ;
+  }
+  else
+    i = shard_rr++ % shards;
+
+  return mpmc_insert_items(shard[i], items, n);
+}
+
+/*
+ *
+ * Sharded remove: take up to count items from this consumer's own shard, and when it
+ * is empty steal up to half of the fullest other shard's backlog instead.  Only with
+ * nothing to take anywhere does the consumer wait (see wait_step), and then on the
+ * next slot of its own shard, which its producers will fill; every other shard has
+ * an owner of its own, which takes its stop item.  With -k nothing is stolen: a thief
+ * could handle an item while the owner still handles an earlier one with the same
+ * key.  Returns the number of items removed.
+ *
+ */
+int shard_remove_items(buffer_item *items, int count)
+{
+  MpmcQueue *own = shard[shard_home], *victim;
+  MpmcSlot *slot;
+  unsigned long pos, seq;
+  int n, backlog, round = 0;
+
+  while (1)
+  {
+    n = mpmc_try_remove_items(own, items, count, 0);
+    if (n > 0)
+      break;
+
+    victim = shard_key ? NULL : shard_fullest(own, &backlog);
+    if (victim != NULL)
+    {
+      n = mpmc_try_remove_items(victim, items, backlog / 2 + 1 < count ? backlog / 2 + 1
+                                : count, 1);
+      if (n > 0)
+        break;
+    }
+
+    pos = __atomic_load_n(&own->tail, __ATOMIC_RELAXED);
+    slot = &own->slots[pos % capacity];
+    seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    if ((long) (seq - (pos + 1)) < 0)
+      wait_step(&slot->seq, seq, &slot->waiters, mpmc_bit(pos, 1), &round);
+  }
+  wait_end(round);
+
+  return n;
+}
+
+/*
+ *
+ * The shard other than own with the most items waiting, with their number in
+ * *backlog, or NULL if all others are empty.
+ *
+ */
+MpmcQueue *shard_fullest(MpmcQueue *own, int *backlog)
+{
+  MpmcQueue *fullest = NULL;
+  long waiting;
+  int i;
+
+  *backlog = 0;
+  for (i=0; i<shards; i++)
+  {
+    if (shard[i] == own)
+      continue;
+
+    waiting = (long) (__atomic_load_n(&shard[i]->head, __ATOMIC_RELAXED) -
+                      __atomic_load_n(&shard[i]->tail, __ATOMIC_RELAXED));
+    if (waiting > *backlog)
+    {
+      *backlog = waiting;
+      fullest = shard[i];
+    }
+  }
+
+  return fullest;
+}
+
+/*
+ *
+ * Reserve the next record slot of the MPMC queue for writing, waiting while the queue
+ * is full.  The caller writes up to record_size bytes at rec->data and must then
+ * commit the slot; consumers cannot get past it until then.
+ *
+ */
+int record_reserve(Record *rec)
+{
+  rec->pos = mpmc_claim(mq, &mq->head, 0);
+  rec->data = mq_data + (rec->pos % capacity) * record_stride;
+  rec->len = 0;
+
+  return 0;
+}
+
+/*
+ *
+ * Publish the record written into a reserved slot, len bytes long.  A len over
+ * record_size is cut to record_size and reported with -1, since the slot has to be
+ * published either way.
+ *
+ */
+int record_commit(const Record *rec, int len)
+{
+  MpmcSlot *slot = &mq->slots[rec->pos % capacity];
+  int retval = 0;
+
+  if (len < 0 || len > record_size)
+  {
+    len = len < 0 ? 0 : record_size;
+    retval = -1;
+  }
+
+  slot->len = len;
+  publish(&slot->seq, rec->pos + 1, &slot->waiters, mpmc_bit(rec->pos, 1));
+
+  return retval;
+}
+
+/*
+ *
+ * Take the next committed record of the MPMC queue, waiting while the queue is empty.
+ * rec->data and rec->len describe the record in place; the caller must release the
+ * slot when done with it.
+ *
+ */
+int record_read(Record *rec)
+{
+  rec->pos = mpmc_claim(mq, &mq->tail, 1);
+  rec->data = mq_data + (rec->pos % capacity) * record_stride;
+  rec->len = mq->slots[rec->pos % capacity].len;
+
+  return 0;
+}
+
+/*
+ *
+ * Hand a record slot taken by record_read back to the producers.
+ *
+ */
+int record_release(const Record *rec)
+{
+  MpmcSlot *slot = &mq->slots[rec->pos % capacity];
+
+  publish(&slot->seq, rec->pos + capacity, &slot->waiters,
+          mpmc_bit(rec->pos + capacity, 0));
+
+  return 0;
+}
+
+/*
+ *
+ * Baseline insert through the pipe: up to count items in one write.  A write of at
+ * most PIPE_BUF bytes is never split or interleaved with another, so items from
+ * different producers stay whole.  Returns the number of items written, or -1.
+ *
+ */
+int pipe_insert_items(const buffer_item *items, int count)
+{
+  ssize_t n;
+
+  if (count > (int) (PIPE_BUF / sizeof(buffer_item)))
+    count = PIPE_BUF / sizeof(buffer_item);
+
+  do
+    n = write(pipe_fd[1], items, count * sizeof(buffer_item));
+  while (n < 0 && errno == EINTR);
+
+  return n < 0 ? -1 : (int) (n / sizeof(buffer_item));
+}
+
+/*
+ *
+ * Baseline remove through the pipe: read up to count items.  Every write is a whole
+ * number of items, so every read is too.  Returns the number of items read, or -1.
+ *
+ */
+int pipe_remove_items(buffer_item *items, int count)
+{
+  ssize_t n;
+
+  do
+    n = read(pipe_fd[0], items, count * sizeof(buffer_item));
+  while (n < 0 && errno == EINTR);
+
+  return n <= 0 ? -1 : (int) (n / sizeof(buffer_item));
+}
+
+/*
+ *
+ * One round of waiting for *word to change from old.  The first rounds, up to this
+ * thread's spin limit, just pause; the next YIELD_ROUNDS yield the CPU; after that the
+ * thread counts itself in *waiters and sleeps on the futex until a publish with one of
+ * its bits wakes it (see publish).  The caller rechecks its condition after every
+ * round.  Returns 1 if the thread was woken from sleep, and 0 otherwise.
+ *
+ */
+int wait_step(unsigned long *word, unsigned long old, unsigned int *waiters, uint32_t bits,
+              int *round)
+{
+  const int spins = spin_limit < spin_max ? spin_limit : spin_max;
+  long woken = -1;
+
+  if (*round == 0)
+    wait_start = now();
+
+  if (*round < spins)
+    cpu_relax();
+  else if (*round < spins + YIELD_ROUNDS)
+    sched_yield();
+  else
+  {
+    // the count must be visible before the word is checked a last time, and publish
+    // stores the word before checking the count, so one of the two sees the other.
+    __atomic_add_fetch(waiters, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(word, __ATOMIC_SEQ_CST) == old)
+      woken = syscall(SYS_futex, futex_word(word), FUTEX_WAIT_BITSET | futex_private,
+                      (uint32_t) old, NULL, NULL, bits);
+    __atomic_sub_fetch(waiters, 1, __ATOMIC_SEQ_CST);
+  }
+
+  (*round)++;
+
+  return woken == 0;
+}
+
+/*
+ *
+ * Adapt this thread's spin limit after a wait of round rounds: a wait that ended while
+ * still spinning suggests spinning pays off here, one that had to sleep that it does
+ * not.  The wait's length is added to wait_time.
+ *
+ */
+void wait_end(int round)
+{
+  if (round == 0)
+    return;
+
+  wait_time += now() - wait_start;
+
+  if (round <= spin_limit && spin_limit < SPIN_MAX)
+    spin_limit *= 2;
+  else if (round > spin_limit + YIELD_ROUNDS && spin_limit > SPIN_MIN)
+    spin_limit /= 2;
+}
+
+/*
+ *
+ * Store value into *word and wake one thread asleep waiting for it to change with
+ * one of bits, if there is any; a publish with nobody asleep makes no system call.
+ * One is enough because every word has at most one waiter per bit: an SPSC index or
+ * log buffer has a single waiter, and each sleeper on an MPMC slot waits for a turn
+ * of its own (see mpmc_claim).  A bulk operation publishes, and so wakes, per slot.
+ *
+ */
+void publish(unsigned long *word, unsigned long value, unsigned int *waiters,
+             uint32_t bits)
+{
+  __atomic_store_n(word, value, __ATOMIC_SEQ_CST);
+
+  if (__atomic_load_n(waiters, __ATOMIC_SEQ_CST))
+    syscall(SYS_futex, futex_word(word), FUTEX_WAKE_BITSET | futex_private, 1, NULL,
+            NULL, bits);
+}
+
+/*
+ *
+ * sem_wait, but spinning and yielding on sem_trywait first as wait_step does, so a
+ * short wait stays in user space.  sem_post already wakes a single sleeper.
+ *
+ */
+int sem_wait_adaptive(sem_t *sem)
+{
+  const int spins = spin_limit < spin_max ? spin_limit : spin_max;
+  int round, retval;
+
+  for (round=0; round<spins + YIELD_ROUNDS; round++)
+  {
+    if (sem_trywait(sem) == 0)
+    {
+      wait_end(round);
+      return 0;
+    }
+
+    if (round == 0)
+      wait_start = now();
+    if (round < spins)
+      cpu_relax();
+    else
+      sched_yield();
+  }
+
+  retval = sem_wait(sem);
+  wait_end(round + 1);
+
+  return retval;
+}
+
+/*
+ *
+ * The 32-bit half of *word that changes first, which is what a futex waits on.
+ *
+ */
+uint32_t *futex_word(unsigned long *word)
+{
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  return (uint32_t *) word + (sizeof(unsigned long) / sizeof(uint32_t) - 1);
+#else
+  return (uint32_t *) word;
+#endif
+}
+
+/*
+ *
+ * Seed this thread's generator for stream number stream (the thread's number) of
+ * seed.  splitmix64 of the two spreads nearby seeds and streams over the whole state,
+ * and never leaves it 0, where xorshift would stay.
+ *
+ */
+void rng_seed(unsigned long stream)
+{
+  uint64_t z = seed * 0x9e3779b97f4a7c15ULL + (stream + 1) * 0xbf58476d1ce4e5b9ULL;
+
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  z ^= z >> 31;
+
+  rng_state = z ? z : 1;
+}
+
+/*
+ *
+ * Next 32-bit number from this thread's xorshift64* generator: a few shifts and a
+ * multiply on thread-local state, with no lock and no shared cache line.
+ *
+ */
+uint32_t rng_next(void)
+{
+  rng_state ^= rng_state >> 12;
+  rng_state ^= rng_state << 25;
+  rng_state ^= rng_state >> 27;
+
+  return (uint32_t) ((rng_state * 0x2545f4914f6cdd1dULL) >> 32);
+}
+
+/*
+ *
+ * Log a printf-style line at level, if -v asks for it, by appending it to this
+ * thread's log buffer; the log writer writes it out later.  A line longer than
+ * LOG_LINE is cut short.  Waits only if the buffer is full.
+ *
+ */
+void log_msg(int level, const char *fmt, ...)
+{
+  char line[LOG_LINE];
+  LogBuf *lb = log_buf;
+  unsigned long head, tail;
+  va_list ap;
+  int len, at, first, round = 0;
+
+  if (level > log_level)
+    return;
+
+  va_start(ap, fmt);
+  len = vsnprintf(line, sizeof(line), fmt, ap);
+  va_end(ap);
+
+  if (len < 0)
+    return;
+  if (len >= LOG_LINE)
+  {
+    len = LOG_LINE - 1;
+    line[len - 1] = '\n';
+  }
+
+  if (lb == NULL)
+    lb = log_register();
+
+  head = lb->head;
+  while (1)
+  {
+    tail = __atomic_load_n(&lb->tail, __ATOMIC_ACQUIRE);
+    if (head - tail + len <= LOG_BUF)
+      break;
+    wait_step(&lb->tail, tail, &lb->tail_waiters, FUTEX_BITSET_MATCH_ANY, &round);
+  }
+  wait_end(round);
+
+  // the line may wrap around the end of the ring.
+  at = head % LOG_BUF;
+  first = LOG_BUF - at < len ? LOG_BUF - at : len;
+  memcpy(lb->data + at, line, first);
+  memcpy(lb->data, line + first, len - first);
+
+  __atomic_store_n(&lb->head, head + len, __ATOMIC_RELEASE);
+}
+
+/*
+ *
+ * Give this thread a log buffer and chain it onto log_bufs for the log writer.
+ * Buffers last as long as the process.
+ *
+ */
+LogBuf *log_register(void)
+{
+  LogBuf *lb = aligned_alloc_or_die(sizeof(LogBuf));
+
+  lb->head = lb->tail = 0;
+  lb->tail_waiters = 0;
+  lb->next = __atomic_load_n(&log_bufs, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n(&log_bufs, &lb->next, lb, 1, __ATOMIC_RELEASE,
+                                      __ATOMIC_RELAXED))
+    ;
+
+  log_buf = lb;
+  return lb;
+}
+
+/*
+ *
+ * Start the log writer, unless nothing is to be logged.
+ *
+ */
+void log_start(void)
+{
+  if (log_level <= 0)
+    return;
+
+  fflush(stdout);
+  if (pthread_create(&log_tid, NULL, log_writer, NULL))
+  {
+    perror("[ERROR]");
+    exit(EXIT_FAILURE);
+  }
+}
+
+/*
+ *
+ * Have the log writer write out everything logged so far, and wait until it has.
+ *
+ */
+void log_finish(void)
+{
+  if (log_level <= 0)
+    return;
+
+  __atomic_store_n(&log_stop, 1, __ATOMIC_RELEASE);
+  pthread_join(log_tid, NULL);
+}
+
+/*
+ *
+ * Log writer thread: drain the log buffers until told to stop, sleeping for
+ * LOG_IDLE_US whenever they are all empty, then drain them one last time.
+ *
+ */
+void *log_writer(void *param)
+{
+  (void) param;
+
+  while (!__atomic_load_n(&log_stop, __ATOMIC_ACQUIRE))
+    if (log_drain() == 0)
+      usleep(LOG_IDLE_US);
+  log_drain();
+
+  return NULL;
+}
+
+/*
+ *
+ * Write out every log buffer's pending bytes, up to LOG_IOV iovecs per writev (a
+ * buffer's bytes take two when they wrap), then hand the space back to each buffer's
+ * thread.  Output that cannot be written is dropped rather than left to block the
+ * threads.  Returns the number of bytes taken from the buffers.
+ *
+ */
+long log_drain(void)
+{
+  struct iovec iov[LOG_IOV];
+  LogBuf *bufs[LOG_IOV];
+  unsigned long heads[LOG_IOV];
+  LogBuf *lb = __atomic_load_n(&log_bufs, __ATOMIC_ACQUIRE);
+  unsigned long head, len, at;
+  long total = 0;
+  int i, n = 0, count = 0;
+
+  while (1)
+  {
+    if (lb == NULL || n > LOG_IOV - 2)
+    {
+      writev_all(STDOUT_FILENO, iov, n);
+      for (i=0; i<count; i++)
+        publish(&bufs[i]->tail, heads[i], &bufs[i]->tail_waiters,
+                FUTEX_BITSET_MATCH_ANY);
+      n = count = 0;
+
+      if (lb == NULL)
+        break;
+    }
+
+    head = __atomic_load_n(&lb->head, __ATOMIC_ACQUIRE);
+    len = head - lb->tail;
+    if (len > 0)
+    {
+      at = lb->tail % LOG_BUF;
+      iov[n].iov_base = lb->data + at;
+      iov[n].iov_len = len < LOG_BUF - at ? len : LOG_BUF - at;
+      if (iov[n++].iov_len < len)
+      {
+        iov[n].iov_base = lb->data;
+        iov[n].iov_len = len - iov[n - 1].iov_len;
+        n++;
+      }
+
+      bufs[count] = lb;
+      heads[count++] = head;
+      total += len;
+    }
+
+    lb = lb->next;
+  }
+
+  return total;
+}
+
+/*
+ *
+ * writev all count iovecs to fd, however many calls it takes.  iov is used up in the
+ * process.  Returns 0, or -1 on failure.
+ *
+ */
+int writev_all(int fd, struct iovec *iov, int count)
+{
+  ssize_t n;
+
+  while (count > 0)
+  {
+    n = writev(fd, iov, count);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+      return -1;
+
+    for (; count > 0 && (size_t) n >= iov->iov_len; iov++, count--)
+      n -= iov->iov_len;
+    if (count > 0)
+    {
+      iov->iov_base = (char *) iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+
+  return 0;
+}
+
+/*
+ *
+ * Threaded producer function:
+ * Loops until stopping is set, producing random numbers for buffer.  param is the
+ * thread's Worker, whose number picks its random number stream.
+ *
+ */
+void *producer(void *param)
+{
+  Worker *w = param;
+  buffer_item my_rand[batch];
+  Record rec;
+  double before;
+  int i, j, n;
+
+  rng_seed(w->number);
+  shard_rr = w->shard;
+
+  while (1)
+  {
+    nap(rng_next() % 5 + 1);
+    if (__atomic_load_n(&stopping, __ATOMIC_ACQUIRE))
+      break;
+
+    // a record is written as text straight into its slot.
+    if (record_size > 0)
+    {
+      before = wait_time;
+      record_reserve(&rec);
+      w->blocked += wait_time - before;
+
+      // a truncated number leaves snprintf's terminating NUL in the last byte, which
+      // is not part of the record.
+      n = snprintf(rec.data, record_size, "%d", rng_next() % RAND_MAX);
+      if (n > record_size - 1)
+        n = record_size - 1;
+
+      // once committed, the slot belongs to the consumers.
+      log_msg(LOG_ITEM, "Producer produced %.*s\n", n, rec.data);
+      record_commit(&rec, n);
+      w->items++;
+      continue;
+    }
+
+    for (i=0; i<batch; i++)
+      my_rand[i] = rng_next() % RAND_MAX;
+
+    // the buffer may take the burst in several pieces.
+    for (i=0; i<batch; i+=n)
+    {
+      before = wait_time;
+      n = insert_items(&my_rand[i], batch - i);
+      w->blocked += wait_time - before;
+      if (n < 0)
+      {
+        log_msg(LOG_ERROR, "[ERROR]: failure in critical section of producer thread!\n");
+        break;
+      }
+      for (j=i; j<i+n; j++)
+        log_msg(LOG_ITEM, "Producer produced %d\n", my_rand[j]);
+      w->items += n;
+    }
+  }
+
+  return NULL;
+}
+
+/*
+ *
+ * Threaded consumer function:
+ * Loops until it takes its stop item, consuming random numbers from buffer.  Once
+ * stopping is set it no longer naps, so the buffer drains quickly.  Stop items
+ * beyond the first, and those of other processes, are put back.  param is the
+ * thread's Worker, as for producer.
+ *
+ */
+void *consumer(void *param)
+{
+  Worker *w = param;
+  buffer_item remove_rand[batch];
+  buffer_item item;
+  Record rec;
+  double before;
+  int i, n, stops = 0;
+
+  rng_seed(w->number);
+  shard_home = w->shard;
+
+  while (!stops)
+  {
+    nap(rng_next() % 5 + 1);
+
+    // a stop record is empty and carries the stop item.
+    if (record_size > 0)
+    {
+      before = wait_time;
+      record_read(&rec);
+      w->blocked += wait_time - before;
+
+      item = 0;
+      if (rec.len == 0)
+        memcpy(&item, rec.data, sizeof(buffer_item));
+      else
+      {
+        log_msg(LOG_ITEM, "Consumer consumed %.*s\n", rec.len, rec.data);
+        w->items++;
+      }
+      record_release(&rec);
+
+      if (item == stop_item)
+        stops++;
+      else if (item < 0)
+        record_stop(item);
+      continue;
+    }
+
+    before = wait_time;
+    n = remove_items(remove_rand, batch);
+    w->blocked += wait_time - before;
+    if (n < 0)
+      log_msg(LOG_ERROR, "[ERROR]: failure in critical section of consumer thread!\n");
+
+    for (i=0; i<n; i++)
+    {
+      if (remove_rand[i] == stop_item)
+        stops++;
+      else if (remove_rand[i] < 0)
+      {
+        if (insert_item(remove_rand[i]))
+          log_msg(LOG_ERROR, "[ERROR]: failure in critical section of consumer thread!\n");
+      }
+      else
+      {
+        log_msg(LOG_ITEM, "Consumer consumed %d\n", remove_rand[i]);
+        w->items++;
+      }
+    }
+  }
+
+  for (i=1; i<stops; i++)
+    if (insert_item(stop_item))
+      log_msg(LOG_ERROR, "[ERROR]: failure in critical section of consumer thread!\n");
+
+  return NULL;
+}
+
+/*
+ *
+ * Sleep for seconds seconds, one at a time, so that a thread notices stopping within
+ * a second.
+ *
+ */
+void nap(int seconds)
+{
+  int i;
+
+  for (i=0; i<seconds && !__atomic_load_n(&stopping, __ATOMIC_ACQUIRE); i++)
+    sleep(1);
+}
+
+/*
+ *
+ * Queue a stop record carrying item: an empty record, which no producer makes.
+ *
+ */
+void record_stop(buffer_item item)
+{
+  Record rec;
+
+  record_reserve(&rec);
+  memcpy(rec.data, &item, sizeof(buffer_item));
+  record_commit(&rec, 0);
+}
+
+/*
+ *
+ * Print what each of the producers and consumers in worker moved, its throughput
+ * over elapsed seconds and how long it was blocked, then the totals.  Waits inside
+ * the kernel, as on a pipe, are not counted as blocked.
+ *
+ */
+void print_stats(const Worker *worker, int producers, int consumers, double elapsed)
+{
+  long produced = 0, consumed = 0;
+  int i;
+
+  for (i=0; i<producers + consumers; i++)
+  {
+    printf("%s %d: %ld items, %.2f items/s, %.3f s blocked on %s buffer\n",
+           i < producers ? "Producer" : "Consumer", i < producers ? i : i - producers,
+           worker[i].items, worker[i].items / elapsed, worker[i].blocked,
+           i < producers ? "a full" : "an empty");
+    if (i < producers)
+      produced += worker[i].items;
+    else
+      consumed += worker[i].items;
+  }
+
+  printf("Total: %ld produced, %ld consumed, %.2f items/s over %.3f s\n", produced,
+         consumed, consumed / elapsed, elapsed);
+}
+
+/*
+ *
+ * Benchmark the queue for every combination of 1, 2, 4, ... up to producers producer
+ * threads and consumers consumer threads (only 1 and 1 for spsc), printing one CSV
+ * row per run.  Each run moves items items, or runs for seconds seconds if items is 0.
+ *
+ */
+int run_bench(int producers, int consumers, int seconds, long items)
+{
+  const char *names[] = { "sem", "spsc", "mpmc", "pipe", "shard" };
+  const char *name = shm_name != NULL ? "mpmc-shm" : shard_key ? "shard-key" : names[queue];
+  unsigned long hist[HIST_BUCKETS];
+  double elapsed;
+  long moved;
+  int p, c;
+
+  if (producers < 1 || consumers < 1 || (items <= 0 && seconds < 1))
+  {
+    printf("[ERROR]: a benchmark needs threads and an item count or a duration\n");
+    return EXIT_FAILURE;
+  }
+
+  printf("queue,producers,consumers,capacity,batch,record_bytes,items,seconds,ops_per_sec,"
+         "p50_ns,p99_ns,p999_ns\n");
+
+  for (p=1; ; p=(p * 2 < producers ? p * 2 : producers))
+  {
+    for (c=1; ; c=(c * 2 < consumers ? c * 2 : consumers))
+    {
+      if (queue != QUEUE_SPSC || (p == 1 && c == 1))
+      {
+        elapsed = bench_run(p, c, seconds, items, hist, &moved);
+        printf("%s,%d,%d,%d,%d,%d,%ld,%.6f,%.0f,%u,%u,%u\n", name, p, c, capacity,
+               batch, record_size, moved, elapsed, moved / elapsed, hist_percentile(hist, 0.5),
+               hist_percentile(hist, 0.99), hist_percentile(hist, 0.999));
+        fflush(stdout);
+      }
+
+      if (c == consumers)
+        break;
+    }
+
+    if (p == producers)
+      break;
+  }
+
+  return 0;
+}
+
+/*
+ *
+ * One benchmark run: start the threads, let the producers insert their quotas (or
+ * stop them after seconds), then insert one BENCH_STOP per consumer behind the last
+ * real item and wait for the consumers to drain everything.  The consumers'
+ * histograms are summed into hist and the items moved stored in moved.  Returns the
+ * elapsed time in seconds.
+ *
+ * With -m or -q pipe the consumers run in a child process, forked before any thread
+ * exists, which sends moved and hist back through a pipe of its own.
+ *
+ */
+double bench_run(int producers, int consumers, int seconds, long items,
+                 unsigned long *hist, long *moved)
+{
+  BenchThread *thread = calloc(producers + consumers, sizeof(BenchThread));
+  const int split = shm_name != NULL || queue == QUEUE_PIPE;
+  Record rec;
+  double start, elapsed;
+  pid_t child = 0;
+  int i, result[2];
+
+  if (thread == NULL)
+  {
+    perror("[ERROR]");
+    exit(EXIT_FAILURE);
+  }
+
+  shards = consumers;
+  buffer_init();
+  bench_done = 0;
+
+  for (i=0; i<producers; i++)
+    thread[i].quota = items / producers + (i < items % producers);
+  for (i=0; i<producers + consumers; i++)
+    thread[i].shard = i < producers ? i : i - producers;
+
+  start = now();
+  if (split)
+  {
+    if (pipe(result) || (child = fork()) < 0)
+    {
+      perror("[ERROR]");
+      exit(EXIT_FAILURE);
+    }
+
+    if (child == 0)
+    {
+      close(result[0]);
+      bench_start(&thread[producers], consumers, bench_consumer);
+      bench_collect(&thread[producers], consumers, hist, moved);
+      if (write_all(result[1], moved, sizeof(*moved)) ||
+          write_all(result[1], hist, HIST_BUCKETS * sizeof(unsigned long)))
+        perror("[ERROR]");
+      _exit(EXIT_SUCCESS);
+    }
+    close(result[1]);
+  }
+
+  bench_start(thread, producers, bench_producer);
+  if (!split)
+    bench_start(&thread[producers], consumers, bench_consumer);
+
+  if (items <= 0)
+  {
+    sleep(seconds);
+    bench_done = 1;
+  }
+
+  for (i=0; i<producers; i++)
+    pthread_join(thread[i].tid, NULL);
+
+  // in record mode an empty record is the stop item.
+  for (i=0; i<consumers; i++)
+  {
+    if (record_size > 0)
+    {
+      record_reserve(&rec);
+      record_commit(&rec, 0);
+    }
+    else if (insert_item(BENCH_STOP))
+      printf("[ERROR]: failure in critical section of benchmark!\n");
+  }
+
+  if (split)
+  {
+    if (read_all(result[0], moved, sizeof(*moved)) ||
+        read_all(result[0], hist, HIST_BUCKETS * sizeof(unsigned long)))
+    {
+      printf("[ERROR]: benchmark consumer process failed\n");
+      exit(EXIT_FAILURE);
+    }
+    close(result[0]);
+    waitpid(child, NULL, 0);
+  }
+  else
+    bench_collect(&thread[producers], consumers, hist, moved);
+  elapsed = now() - start;
+
+  buffer_destroy();
+  free(thread);
+
+  return elapsed;
+}
+
+/*
+ *
+ * Start count benchmark threads running func, each on its own BenchThread.
+ *
+ */
+void bench_start(BenchThread *thread, int count, void *(*func)(void *))
+{
+  int i;
+
+  for (i=0; i<count; i++)
+  {
+    if (pthread_create(&thread[i].tid, NULL, func, &thread[i]))
+    {
+      perror("[ERROR]");
+      exit(EXIT_FAILURE);
+    }
+  }
+}
+
+/*
+ *
+ * Wait for count benchmark consumers to finish, then sum their histograms into hist
+ * and their items into moved.
+ *
+ */
+void bench_collect(BenchThread *thread, int count, unsigned long *hist, long *moved)
+{
+  int i, j;
+
+  memset(hist, 0, HIST_BUCKETS * sizeof(unsigned long));
+  *moved = 0;
+
+  for (i=0; i<count; i++)
+  {
+    pthread_join(thread[i].tid, NULL);
+    for (j=0; j<HIST_BUCKETS; j++)
+      hist[j] += thread[i].hist[j];
+    *moved += thread[i].items;
+  }
+}
+
+/*
+ *
+ * Write all size bytes of data to fd, however many writes it takes.  Returns 0, or -1
+ * on failure.
+ *
+ */
+int write_all(int fd, const void *data, size_t size)
+{
+  const char *p = data;
+  ssize_t n;
+
+  while (size > 0)
+  {
+    n = write(fd, p, size);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return -1;
+    p += n;
+    size -= n;
+  }
+
+  return 0;
+}
+
+/*
+ *
+ * Read exactly size bytes from fd into data.  Returns 0, or -1 on failure or if fd
+ * ends first.
+ *
+ */
+int read_all(int fd, void *data, size_t size)
+{
+  char *p = data;
+  ssize_t n;
+
+  while (size > 0)
+  {
+    n = read(fd, p, size);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return -1;
+    p += n;
+    size -= n;
+  }
+
+  return 0;
+}
+
+/*
+ *
+ * Benchmark producer: insert bursts of batch items stamped with the current time,
+ * without sleeping or printing, until the quota is met or bench_done is set.  In
+ * record mode each record is written in place: the stamp, then filler up to
+ * record_size bytes.
+ *
+ */
+void *bench_producer(void *param)
+{
+  BenchThread *t = param;
+  buffer_item items[batch];
+  Record rec;
+  int i, n, count;
+
+  shard_rr = t->shard;
+  while (t->quota > 0 ? t->items < t->quota : !bench_done)
+  {
+    if (record_size > 0)
+    {
+      items[0] = bench_stamp();
+      record_reserve(&rec);
+      memcpy(rec.data, &items[0], sizeof(buffer_item));
+      memset(rec.data + sizeof(buffer_item), 'x', record_size - sizeof(buffer_item));
+      record_commit(&rec, record_size);
+      t->items++;
+      continue;
+    }
+
+    count = batch;
+    if (t->quota > 0 && t->quota - t->items < count)
+      count = t->quota - t->items;
+
+    items[0] = bench_stamp();
+    for (i=1; i<count; i++)
+      items[i] = items[0];
+
+    for (i=0; i<count; i+=n)
+    {
+      n = insert_items(&items[i], count - i);
+      if (n < 0)
+      {
+        printf("[ERROR]: failure in critical section of producer thread!\n");
+        return NULL;
+      }
+    }
+
+    t->items += count;
+  }
+
+  return NULL;
+}
+
+/*
+ *
+ * Benchmark consumer: remove up to batch items at a time and record how long each
+ * spent between insert and remove, until a BENCH_STOP arrives.  Stop items beyond the
+ * first belong to other consumers and are put back.  Records are read in place and
+ * an empty one stops the consumer.
+ *
+ */
+void *bench_consumer(void *param)
+{
+  BenchThread *t = param;
+  buffer_item items[batch];
+  buffer_item stamp;
+  Record rec;
+  int i, n, stops = 0;
+
+  shard_home = t->shard;
+  while (!stops)
+  {
+    if (record_size > 0)
+    {
+      record_read(&rec);
+      stamp = bench_stamp();
+      if (rec.len == 0)
+        stops = 1;
+      else
+      {
+        memcpy(&items[0], rec.data, sizeof(buffer_item));
+        t->hist[hist_index((uint32_t) stamp - (uint32_t) items[0])]++;
+        t->items++;
+      }
+      record_release(&rec);
+      continue;
+    }
+
+    n = remove_items(items, batch);
+    if (n < 0)
+    {
+      printf("[ERROR]: failure in critical section of consumer thread!\n");
+      return NULL;
+    }
+
+    stamp = bench_stamp();
+    for (i=0; i<n; i++)
+    {
+      if (items[i] == BENCH_STOP)
+        stops++;
+      else
+      {
+        // the stamps are 32-bit, so the difference is right as long as no item waits
+        // four seconds.
+        t->hist[hist_index((uint32_t) stamp - (uint32_t) items[i])]++;
+        t->items++;
+      }
+    }
+  }
+
+  for (i=1; i<stops; i++)
+    if (insert_item(BENCH_STOP))
+      printf("[ERROR]: failure in critical section of consumer thread!\n");
+
+  return NULL;
+}
+
+/*
+ *
+ * Low 32 bits of the monotonic clock in nanoseconds, as a benchmark item.  The one
+ * value that would look like BENCH_STOP is moved a nanosecond earlier.
+ *
+ */
+buffer_item bench_stamp(void)
+{
+  struct timespec ts;
+  uint32_t ns;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  ns = (uint32_t) ts.tv_sec * 1000000000u + (uint32_t) ts.tv_nsec;
+
+  return (buffer_item) ns == BENCH_STOP ? (buffer_item) (ns - 1) : (buffer_item) ns;
+}
+
+/*
+ *
+ * Histogram bucket of a latency of ns nanoseconds: ns itself below HIST_SUB, otherwise
+ * HIST_SUB buckets for each power of two, indexed by the HIST_SHIFT bits after the
+ * leading one.
+ *
+ */
+int hist_index(unsigned int ns)
+{
+  int e;
+
+  if (ns < HIST_SUB)
+    return ns;
+
+  e = 31 - __builtin_clz(ns);
+  return (e - HIST_SHIFT + 1) * HIST_SUB + ((ns >> (e - HIST_SHIFT)) & (HIST_SUB - 1));
+}
+
+/*
+ *
+ * Smallest latency in nanoseconds that falls into histogram bucket index.
+ *
+ */
+unsigned int hist_value(int index)
+{
+  int e = index / HIST_SUB + HIST_SHIFT - 1;
+
+  if (index < HIST_SUB)
+    return index;
+
+  return (unsigned int) (HIST_SUB + index % HIST_SUB) << (e - HIST_SHIFT);
+}
+
+/*
+ *
+ * Latency below which a fraction q of the histogram's samples fall, or 0 if it is
+ * empty.
+ *
+ */
+unsigned int hist_percentile(const unsigned long *hist, double q)
+{
+  unsigned long total = 0, seen = 0;
+  int i;
+
+  for (i=0; i<HIST_BUCKETS; i++)
+    total += hist[i];
+
+  for (i=0; i<HIST_BUCKETS; i++)
+  {
+    seen += hist[i];
+    if (seen > 0 && seen >= q * total)
+      return hist_value(i);
+  }
+
+  return 0;
+}
+
+/*
+ *
+ * Monotonic time in seconds.
+ *
+ */
+double now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ *
+ * Set up the stages of a pipeline from a -P spec, a comma-separated list of
+ * <threads>[:<work>] entries.  Returns 0, or -1 if the spec is malformed or asks for
+ * more than PIPE_THREADS threads.
+ *
+ */
+int parse_pipeline(const char *spec)
+{
+  char *end;
+  int threads = 0;
+
+  for (stages=0; stages<PIPE_STAGES; stages++)
+  {
+    memset(&stage[stages], 0, sizeof(Stage));
+    stage[stages].index = stages;
+    stage[stages].target = strtol(spec, &end, 10);
+    threads += stage[stages].target;
+    if (end == spec || stage[stages].target < 1 || threads > PIPE_THREADS)
+      return -1;
+
+    if (*end == ':')
+    {
+      spec = end + 1;
+      stage[stages].cost = strtol(spec, &end, 10);
+      if (end == spec || stage[stages].cost < 0)
+        return -1;
+    }
+
+    if (*end == '\0')
+    {
+      stages++;
+      return 0;
+    }
+    if (*end != ',')
+      return -1;
+    spec = end + 1;
+  }
+
+  return -1;
+}
+
+/*
+ *
+ * Run the pipeline for seconds seconds: chain the stages with buffers of capacity
+ * slots, start their threads, and once a second print each stage's threads, items per
+ * second, input buffer occupancy and the percentage of its thread time stalled on
+ * input and on output since the last report.  With -A the threads are then
+ * rebalanced.  Then stop the stages from upstream down, so that every item made is
+ * carried to the end, free the buffers and print each stage's totals.
+ *
+ */
+int run_pipeline(int seconds)
+{
+  double items[PIPE_STAGES], stall_in[PIPE_STAGES], stall_out[PIPE_STAGES];
+  double stalled[PIPE_STAGES];
+  double start, last, t, thread_time, rate = 0;
+  long occupancy;
+  int i, threads;
+
+  if (seconds < 1)
+  {
+    printf("[ERROR]: a pipeline needs a duration\n");
+    return EXIT_FAILURE;
+  }
+
+  for (i=1; i<stages; i++)
+  {
+    stage[i].in = aligned_alloc_or_die(mpmc_size());
+    memset(stage[i].in, 0, mpmc_size());
+    mpmc_format(stage[i].in);
+    stage[i - 1].out = stage[i].in;
+  }
+
+  printf("second,stage,threads,items_per_sec,occupancy,stall_in_pct,stall_out_pct\n");
+  fflush(stdout);
+
+  memset(items, 0, sizeof(items));
+  memset(stall_in, 0, sizeof(stall_in));
+  memset(stall_out, 0, sizeof(stall_out));
+
+  start = last = now();
+  for (i=0; i<stages; i++)
+    stage_resize(&stage[i], stage[i].target);
+
+  while (last - start < seconds)
+  {
+    sleep(1);
+    t = now();
+
+    for (i=0; i<stages; i++)
+    {
+      // a stage's threads may have changed during the second; count what it has now.
+      threads = __atomic_load_n(&stage[i].running, __ATOMIC_RELAXED);
+      thread_time = (threads > 0 ? threads : 1) * (t - last);
+
+      stalled[i] = 0;
+      occupancy = 0;
+      if (stage[i].in != NULL)
+        occupancy = (long) (__atomic_load_n(&stage[i].in->head, __ATOMIC_RELAXED) -
+                            __atomic_load_n(&stage[i].in->tail, __ATOMIC_RELAXED));
+      if (occupancy < 0)
+        occupancy = 0;
+
+      pthread_mutex_lock(&stage_mutex);
+      printf("%.0f,%d,%d,%.0f,%ld,%.1f,%.1f\n", t - start, i, threads,
+             (stage[i].items - items[i]) / (t - last), occupancy,
+             100 * (stage[i].stall_in - stall_in[i]) / thread_time,
+             100 * (stage[i].stall_out - stall_out[i]) / thread_time);
+      stalled[i] = (stage[i].stall_in - stall_in[i] + stage[i].stall_out - stall_out[i]) /
+                   thread_time;
+      rate = (stage[i].items - items[i]) / (t - last);
+      items[i] = stage[i].items;
+      stall_in[i] = stage[i].stall_in;
+      stall_out[i] = stage[i].stall_out;
+      pthread_mutex_unlock(&stage_mutex);
+    }
+    fflush(stdout);
+
+    if (rebalance)
+      pipeline_rebalance(stalled, rate);
+    last = t;
+  }
+
+  for (i=0; i<stages; i++)
+    stage_stop(&stage[i]);
+  t = now() - start;
+
+  for (i=0; i<stages; i++)
+  {
+    printf("Stage %d: %lu items, %.2f items/s, %.3f s stalled on input, %.3f s on "
+           "output\n", i, stage[i].items, stage[i].items / t, stage[i].stall_in,
+           stage[i].stall_out);
+    free(stage[i].in);
+  }
+  printf("Total: %lu items through %d stages, sum %lu, over %.3f s\n",
+         stage[stages - 1].items, stages, stage[stages - 1].sum, t);
+
+  return 0;
+}
+
+/*
+ *
+ * Give stage st threads threads.  New threads start at once, in the slots of threads
+ * that have left (see stage_reap); surplus ones leave after the item they are
+ * working on (see stage_leave), so no item is lost.
+ *
+ */
+void stage_resize(Stage *st, int threads)
+{
+  int i = 0;
+
+  stage_reap(st);
+  __atomic_store_n(&st->target, threads, __ATOMIC_RELAXED);
+
+  while (__atomic_load_n(&st->running, __ATOMIC_RELAXED) < threads)
+  {
+    // a thread that is leaving holds its slot until it is reaped.
+    while (i < PIPE_THREADS && st->thread[i].used)
+      i++;
+    if (i == PIPE_THREADS)
+      break;
+
+    st->thread[i].stage = st;
+    st->thread[i].used = 1;
+    st->thread[i].left = 0;
+    __atomic_add_fetch(&st->running, 1, __ATOMIC_RELAXED);
+    if (pthread_create(&st->thread[i].tid, NULL, stage_worker, &st->thread[i]))
+    {
+      perror("[ERROR]");
+      exit(EXIT_FAILURE);
+    }
+  }
+}
+
+/*
+ *
+ * Join the threads that have left stage st and free their slots.
+ *
+ */
+void stage_reap(Stage *st)
+{
+  int i;
+
+  for (i=0; i<PIPE_THREADS; i++)
+  {
+    if (st->thread[i].used && __atomic_load_n(&st->thread[i].left, __ATOMIC_ACQUIRE))
+    {
+      pthread_join(st->thread[i].tid, NULL);
+      st->thread[i].used = 0;
+    }
+  }
+}
+
+/*
+ *
+ * Stop stage st once the stages before it are stopped, and join its threads.  Its
+ * target drops to 0: the threads of the first stage leave at their next check (see
+ * stage_leave), while those of a later stage each get a BENCH_STOP queued behind the
+ * last item its input will ever get, so they leave only once it is empty.  A thread
+ * may leave through stage_leave before its stop comes; the stop is then left over.
+ *
+ */
+void stage_stop(Stage *st)
+{
+  int i, threads;
+
+  __atomic_store_n(&st->target, 0, __ATOMIC_RELAXED);
+
+  if (st->in != NULL)
+  {
+    threads = __atomic_load_n(&st->running, __ATOMIC_RELAXED);
+    for (i=0; i<threads; i++)
+      mpmc_insert(st->in, BENCH_STOP);
+  }
+
+  for (i=0; i<PIPE_THREADS; i++)
+  {
+    if (st->thread[i].used)
+    {
+      pthread_join(st->thread[i].tid, NULL);
+      st->thread[i].used = 0;
+    }
+  }
+}
+
+/*
+ *
+ * Called by a stage thread between items: if the stage has more threads than it
+ * should, this one leaves it.  A stage with input that is being stopped (target 0)
+ * keeps its threads until their stop items come.  Returns 1 if the thread should
+ * exit.
+ *
+ */
+int stage_leave(Stage *st)
+{
+  int running = __atomic_load_n(&st->running, __ATOMIC_RELAXED);
+  int target;
+
+  while (running > (target = __atomic_load_n(&st->target, __ATOMIC_RELAXED)) &&
+         (target > 0 || st->in == NULL))
+    if (__atomic_compare_exchange_n(&st->running, &running, running - 1, 1,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      return 1;
+
+  return 0;
+}
+
+/*
+ *
+ * Stage thread: take an item (or make one, in the first stage), work on it, and pass
+ * it on (or add it to the sum, in the last stage), until a BENCH_STOP comes in.  The
+ * time spent waiting on either buffer comes from wait_time, which only the slow path
+ * of a wait moves.  The stage's counters are updated every PIPE_FLUSH items, which is
+ * also when the thread checks whether it should leave, and when it stops.
+ *
+ */
+void *stage_worker(void *param)
+{
+  StageThread *self = param;
+  Stage *st = self->stage;
+  buffer_item item;
+  unsigned long items = 0, sum = 0;
+  double in = 0, out = 0, before;
+
+  rng_seed((unsigned long) st->index << 16 | __atomic_fetch_add(&st->spawned, 1,
+                                                                  __ATOMIC_RELAXED));
+
+  while (1)
+  {
+    before = wait_time;
+    if (st->in == NULL)
+      item = rng_next() % RAND_MAX;
+    else
+      mpmc_remove(st->in, &item);
+    in += wait_time - before;
+
+    if (item == BENCH_STOP)
+      break;
+
+    item = stage_work(item, st->cost);
+
+    before = wait_time;
+    if (st->out == NULL)
+      sum += item;
+    else
+      mpmc_insert(st->out, item);
+    out += wait_time - before;
+
+    if (++items == PIPE_FLUSH)
+    {
+      stage_count(st, items, sum, in, out);
+      items = sum = 0;
+      in = out = 0;
+
+      if (stage_leave(st))
+      {
+        __atomic_store_n(&self->left, 1, __ATOMIC_RELEASE);
+        return NULL;
+      }
+    }
+  }
+
+  stage_count(st, items, sum, in, out);
+
+  return NULL;
+}
+
+/*
+ *
+ * Add a stage thread's items, their sum and its stalls on input and output since
+ * the last call to stage st's counters.
+ *
+ */
+void stage_count(Stage *st, unsigned long items, unsigned long sum, double in, double out)
+{
+  pthread_mutex_lock(&stage_mutex);
+  st->items += items;
+  st->stall_in += in;
+  st->stall_out += out;
+  st->sum += sum;
+  pthread_mutex_unlock(&stage_mutex);
+}
+
+/*
+ *
+ * The work a stage does on an item: cost rounds of multiply-and-mix.
+ *
+ */
+buffer_item stage_work(buffer_item item, int cost)
+{
+  uint32_t x = (uint32_t) item;
+  int i;
+
+  for (i=0; i<cost; i++)
+  {
+    x = x * 2654435761u + 0x9e3779b9u;
+    x ^= x >> 15;
+  }
+
+  return (buffer_item) (x & INT_MAX);
+}
+
+/*
+ *
+ * Move one thread from the stage whose threads stalled the largest share of the last
+ * second (and that has a thread to spare) to the one that stalled the least, if the
+ * two shares are at least a quarter apart.  The stage that stalls least is the one
+ * holding the others up.  If no stage with a thread to spare stalls that much more,
+ * as when every stage has a single thread, the bottleneck gets a new thread instead,
+ * as long as the pipeline has fewer threads than CPUs.  rate is the pipeline's items
+ * per second in the last second: a new thread that did not raise it is taken back,
+ * and then no more are added.
+ *
+ */
+void pipeline_rebalance(const double *stalled, double rate)
+{
+  int i, most = -1, least = 0, worst = 0, threads = 0;
+
+  if (grown >= 0)
+  {
+    if (rate <= grown_from)
+    {
+      stage_resize(&stage[grown], stage[grown].target - 1);
+      growing = 0;
+    }
+    grown = -1;
+    return;
+  }
+
+  for (i=0; i<stages; i++)
+  {
+    if (stage[i].target > 1 && (most < 0 || stalled[i] > stalled[most]))
+      most = i;
+    if (stalled[i] < stalled[least])
+      least = i;
+    if (stalled[i] > stalled[worst])
+      worst = i;
+    threads += stage[i].target;
+  }
+
+  if (most >= 0 && most != least && stalled[most] - stalled[least] >= 0.25)
+  {
+    stage_resize(&stage[most], stage[most].target - 1);
+    stage_resize(&stage[least], stage[least].target + 1);
+    return;
+  }
+
+  if (growing && stalled[worst] - stalled[least] >= 0.25 && threads < PIPE_THREADS &&
+      threads < sysconf(_SC_NPROCESSORS_ONLN))
+  {
+    stage_resize(&stage[least], stage[least].target + 1);
+    grown = least;
+    grown_from = rate;
   }
 }